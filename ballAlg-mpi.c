@@ -5,21 +5,33 @@
 #include <assert.h>
 #include <string.h>
 #include "gen_points.h"
+#include "tree_io.h"
+#include "tree_writer.h"
 #include <mpi.h>
 
 int n_dims, n_procs, id;
-long n_points, max_depth, diff;
+long n_points;
+int format = FORMAT_TEXT;
 MPI_Status status;
 
-enum MESSAGES {
-    PRINT = -1
-};
+/* Nodes of at most leaf_size points are leaves; when that is more than one,
+ * a leaf's left is -1 - the position of its first point in this processor's
+ * set and its right how many it has. The set, in leaf order, is kept in
+ * bucket_pts for the dump */
+long leaf_size = 1;
+double *bucket_pts;
+long n_bucket_pts = 0;
+
+/* Local subtrees of at least TASK_MIN points are built as tasks, which idle
+ * threads steal */
+#define TASK_MIN 4096
 
 enum TAGS {
     PTS = 1,
     ID = 2,
     CENTER = 3,
-    INTER = 4
+    INTER = 4,
+    DUMP = 5
 };
 
 typedef struct _node
@@ -77,6 +89,7 @@ void get_furthest_points(double **pts, long l, long r, double **a, double **b)
     }
 
     /* Lock b as first point in set and find a */
+    *a = *b;
     for (i = l; i < r + 1; i++)
     {
         if ((dist = quick_distance(*b, pts[i])) > max_distance)
@@ -226,8 +239,8 @@ void mul_point(double *p1, double constant, double *result)
     }
 }
 
-/* Projects p onto ab */
-void project(double *p, double *a, double *b_a, double *common_factor, double *result)
+/* Projects p onto ab, returning its position along b - a */
+double project(double *p, double *a, double *b_a, double *common_factor, double *result)
 {
     double product;
 
@@ -236,6 +249,24 @@ void project(double *p, double *a, double *b_a, double *common_factor, double *r
 
     mul_point(b_a, product, result);
     add_points(result, a, result);
+    return product;
+}
+
+/* Sign that makes the positions along b_a sort like the projections do */
+double key_sign(double *b_a)
+{
+    for (int d = 0; d < n_dims - 1; d++)
+    {
+        if (b_a[d] > 0)
+        {
+            return 1.0;
+        }
+        else if (b_a[d] < 0)
+        {
+            return -1.0;
+        }
+    }
+    return 1.0;
 }
 
 #pragma endregion
@@ -312,101 +343,55 @@ void quicksort(double *pts, double *projs, long l, long r) {
 
 #pragma region qselect
 
-long median_of_three(double **pts, double **projs, long l, long r)
-{
-    long m = (l + r) / 2;
-    if (less_than(projs[r], projs[l]))
-    {
-        SWAP(projs[r], projs[l]);
-        SWAP(pts[r], pts[l]);
+/* Local set being split by finish_tree: the selection keys are the positions
+ * along b - a, and the points move with them */
+double **local_pts, *local_keys;
+
+#define SELECT_KEY(i) local_keys[i]
+#define SELECT_SWAP(i, j)                     \
+    {                                         \
+        double temp2 = local_keys[i];         \
+        local_keys[i] = local_keys[j];        \
+        local_keys[j] = temp2;                \
+        SWAP(local_pts[i], local_pts[j]);     \
     }
-    if (less_than(projs[m], projs[l]))
-    {
-        SWAP(projs[m], projs[l]);
-        SWAP(pts[m], pts[l]);
-    }
-    if (less_than(projs[r], projs[m]))
-    {
-        SWAP(projs[r], projs[m]);
-        SWAP(pts[r], pts[m]);
-    }
-    return m;
-}
 
-long q_select_partition(double **pts, double **projs, long l, long r, long pivotIndex)
-{
-    double *pivotValue = projs[pivotIndex];
-
-    SWAP(projs[pivotIndex], projs[r]);
-    SWAP(pts[pivotIndex], pts[r]);
-    long storeIndex = l;
-
-    for (long i = l; i < r; i++)
-    {
-        if (less_than(projs[i], pivotValue))
-        {
-            SWAP(projs[storeIndex], projs[i]);
-            SWAP(pts[storeIndex], pts[i]);
-            storeIndex++;
-        }
-    }
-
-    SWAP(projs[r], projs[storeIndex]);
-    SWAP(pts[r], pts[storeIndex]);
-
-    return storeIndex;
-}
+#include "qselect.h"
 
-double *qselect(double **pts, double **projs, long l, long r, long k)
+/* Point at key along b - a, as project places it */
+void key_point(double *a, double *b_a, double key, double sign, double *result)
 {
-    /* This way of doing it uses less stack */
-    while (1)
-    {
-        if (l == r)
-        {
-            return projs[l];
-        }
-        long pivotIndex = median_of_three(pts, projs, l, r);
-        pivotIndex = q_select_partition(pts, projs, l, r, pivotIndex);
-        if (k == pivotIndex)
-        {
-            return projs[k];
-        }
-        else if (k < pivotIndex)
-        {
-            r = pivotIndex - 1;
-        }
-        else
-        {
-            l = pivotIndex + 1;
-        }
-    }
+    mul_point(b_a, key * sign, result);
+    add_points(result, a, result);
 }
 
 /* Computes the median point of a set of points in a line */
-long median(double **pts, double **projs, long l, long r, double *center_pt)
+long median(long l, long r, double *a, double *b_a, double sign, double *center_pt)
 {
     long projs_size = (r - l + 1);
     long k = projs_size / 2;
 
     if (projs_size % 2 != 0)
     {
-        memcpy(center_pt, qselect(pts, projs, l, r, k + l), sizeof(double) * n_dims);
+        key_point(a, b_a, select_kth(l, r, k + l), sign, center_pt);
     }
     else
     {
-        qselect(pts, projs, l, r, k + l);
+        double kth = select_kth(l, r, k + l);
 
         /* Finds point immediately before kth point */
-        double *current = projs[l];
+        double current = local_keys[l];
         for (long i = l + 1; i < l + k; i++)
         {
-            if (less_than(current, projs[i]))
+            if (current < local_keys[i])
             {
-                current = projs[i];
+                current = local_keys[i];
             }
         }
-        mean(current, projs[k + l], center_pt);
+        double before[n_dims], after[n_dims];
+        key_point(a, b_a, current, sign, before);
+        key_point(a, b_a, kth, sign, after);
+        mean(before, after, center_pt);
     }
     k--;
     return k;
@@ -591,7 +576,7 @@ void free_list(node_t *head) {
     free_node(aux);
 }
 
-void finish_tree(double **pts, node_t *nodes, double **projections, long l, long r, long node_id, long depth, long base_id)
+void finish_tree(double **pts, node_t *nodes, long l, long r, long node_id, long base_id)
 {
     node_t *node = &nodes[node_id - base_id];
     
@@ -599,7 +584,7 @@ void finish_tree(double **pts, node_t *nodes, double **projections, long l, long
     node->radius = 0.0;
 
     /* It's a leaf */
-    if (r - l == 0)
+    if (r - l == 0 && leaf_size == 1)
     {
         memcpy(node->center, pts[l], n_dims * sizeof(double));
         node->left = -1;
@@ -607,6 +592,31 @@ void finish_tree(double **pts, node_t *nodes, double **projections, long l, long
         return;
     }
 
+    /* A bucket leaf keeps its points, inside a ball around their mean */
+    if (r - l + 1 <= leaf_size)
+    {
+        for (int d = 0; d < n_dims; d++)
+        {
+            double sum = 0.0;
+            for (long i = l; i < r + 1; i++)
+            {
+                sum += pts[i][d];
+            }
+            node->center[d] = sum / (r - l + 1);
+        }
+        for (long i = l; i < r + 1; i++)
+        {
+            double dist = distance(node->center, pts[i]);
+            if (dist > node->radius)
+            {
+                node->radius = dist;
+            }
+        }
+        node->left = -1 - l;
+        node->right = r - l + 1;
+        return;
+    }
+
     double *a, *b;
 
     get_furthest_points(pts, l, r, &a, &b);
@@ -616,16 +626,20 @@ void finish_tree(double **pts, node_t *nodes, double **projections, long l, long
     sub_points(b, a, b_a);
     double denominator = inner_product(b_a, b_a);
     double common_factor[n_dims];
-    mul_point(b_a, 1 / denominator, common_factor);
+    /* All points coincide when a = b; they then all project onto a */
+    mul_point(b_a, denominator > 0 ? 1 / denominator : 0, common_factor);
 
-    /* Project points onto ab */
+    /* Only the position along ab is kept; the center is rebuilt from it */
+    double sign = key_sign(b_a);
+    double diff[n_dims];
     for (long i = l; i < r + 1; i++)
     {
-        project(pts[i], a, b_a, common_factor, projections[i]);
+        sub_points(pts[i], a, diff);
+        local_keys[i] = inner_product(diff, common_factor) * sign;
     }
 
     /* Find median point and split; 2 in 1 GIGA FAST */
-    long split_index = median(pts, projections, l, r, node->center);
+    long split_index = median(l, r, a, b_a, sign, node->center);
 
     /* Compute radius */
     for (long i = l; i < r + 1; i++)
@@ -638,49 +652,78 @@ void finish_tree(double **pts, node_t *nodes, double **projections, long l, long
     }
 
     node->left = node_id + 1;
-    node->right = node_id + 2 * (split_index + 1);
+    node->right = node_id + 1 + tree_nodes(split_index + 1, leaf_size);
 
-    if (depth < max_depth || (depth == max_depth && omp_get_thread_num() < diff)) {
-#pragma omp taskgroup
-        {
+    if (r - l + 1 >= 2 * TASK_MIN) {
 #pragma omp task
-            finish_tree(pts, nodes, projections, l, l + split_index, node->left, depth + 1, base_id);
-#pragma omp task
-            finish_tree(pts, nodes, projections, l + split_index + 1, r, node->right, depth + 1, base_id);
-        }
+        finish_tree(pts, nodes, l, l + split_index, node->left, base_id);
+        finish_tree(pts, nodes, l + split_index + 1, r, node->right, base_id);
+#pragma omp taskwait
     } else {
-        finish_tree(pts, nodes, projections, l, l + split_index, node->left, depth + 1, base_id);
-        finish_tree(pts, nodes, projections, l + split_index + 1, r, node->right, depth + 1, base_id);
+        finish_tree(pts, nodes, l, l + split_index, node->left, base_id);
+        finish_tree(pts, nodes, l + split_index + 1, r, node->right, base_id);
     }
 }
 
+/* Gathers the team's points at its leader, which gets them all in a new set;
+ * the others are left without points */
+double **gather_points(double **pts, MPI_Comm team, long my_set, long team_set) {
+    int count = my_set * n_dims;
+    int counts[n_procs], displacements[n_procs];
+    double *all = NULL;
+
+    MPI_Gather(&count, 1, MPI_INT, counts, 1, MPI_INT, 0, team);
+    if (!id) {
+        displacements[0] = 0;
+        for (int p = 1; p < n_procs; p++) {
+            displacements[p] = displacements[p - 1] + counts[p - 1];
+        }
+        all = (double*) malloc(team_set * n_dims * sizeof(double));
+        assert(all);
+    }
+    MPI_Gatherv(*pts, count, MPI_DOUBLE, all, counts, displacements, MPI_DOUBLE, 0, team);
+    free(*pts);
+    free(pts);
+
+    if (id) {
+        return NULL;
+    }
+    pts = (double**) malloc(team_set * sizeof(double*));
+    assert(pts);
+    for (long i = 0; i < team_set; i++) {
+        pts[i] = &all[i * n_dims];
+    }
+    return pts;
+}
+
 long build_tree(double **pts, MPI_Comm team, node_t **nodes, long my_set, long team_set, long node_id) {
     MPI_Comm_size(team, &n_procs);
     MPI_Comm_rank(team, &id);
 
-    /* Alone in team, finish sequentially */
-    if (n_procs == 1) {
-        double *to_free = *pts;
-        /* Allocate memory for projections */
-        double **projections = (double **)malloc(my_set * sizeof(double *));
-        assert(projections);
-        double *proj = (double *)malloc(my_set * n_dims * sizeof(double));
-        assert(proj);
-        for (long i = 0; i < my_set; i++)
-        {
-            projections[i] = &proj[i * n_dims];
+    /* A bucket isn't split, so its points go to the leader */
+    if (n_procs > 1 && team_set <= leaf_size) {
+        pts = gather_points(pts, team, my_set, team_set);
+        if (id) {
+            return 0;
         }
+        my_set = team_set;
+    }
 
-        max_depth = (int)log2(omp_get_max_threads());
-        diff = omp_get_max_threads() - (1 << max_depth);
+    /* Alone in team, or with a whole bucket, finish sequentially */
+    if (n_procs == 1 || team_set <= leaf_size) {
+        double *to_free = *pts;
+        local_keys = (double *)malloc(my_set * sizeof(double));
+        assert(local_keys);
+        local_pts = pts;
 
         /* Allocate memory for nodes */
-        node_t *node_arr = (node_t *)malloc((2 * my_set - 1) * sizeof(node_t));
+        long n_nodes = tree_nodes(my_set, leaf_size);
+        node_t *node_arr = (node_t *)malloc(n_nodes * sizeof(node_t));
         assert(nodes);
-        double *centers = (double *)malloc((2 * my_set - 1) * n_dims * sizeof(double));
+        double *centers = (double *)malloc(n_nodes * n_dims * sizeof(double));
         assert(centers);
 
-        for (long i = 0; i < 2 * my_set - 1; i++)
+        for (long i = 0; i < n_nodes; i++)
         {
             node_arr[i].center = &centers[i * n_dims];
         }
@@ -689,14 +732,24 @@ long build_tree(double **pts, MPI_Comm team, node_t **nodes, long my_set, long t
 #pragma omp single
         {
 #pragma omp task
-            finish_tree(pts, node_arr, projections, 0, my_set - 1, node_id, 0, node_id);
+            finish_tree(pts, node_arr, 0, my_set - 1, node_id, node_id);
         }
         *nodes = attach_node(*nodes, node_arr);
-        free(projections);
-        free(proj);
+
+        /* The leaves point into the set as finish_tree left it */
+        if (leaf_size > 1) {
+            bucket_pts = (double *)malloc(my_set * (n_dims - 1) * sizeof(double));
+            assert(bucket_pts);
+            for (long i = 0; i < my_set; i++)
+            {
+                memcpy(&bucket_pts[i * (n_dims - 1)], pts[i], (n_dims - 1) * sizeof(double));
+            }
+            n_bucket_pts = my_set;
+        }
+        free(local_keys);
         free(to_free);
         free(pts);
-        return 2 * my_set - 1;
+        return n_nodes;
     }
 
     /* Find a and b */
@@ -709,7 +762,7 @@ long build_tree(double **pts, MPI_Comm team, node_t **nodes, long my_set, long t
     sub_points(b, a, b_a);
     double denominator = inner_product(b_a, b_a);
     double common_factor[n_dims];
-    mul_point(b_a, 1 / denominator, common_factor);
+    mul_point(b_a, denominator > 0 ? 1 / denominator : 0, common_factor);
 
     /* Allocate memory for projections */
     double *proj = (double*) malloc(my_set * n_dims * sizeof(double));
@@ -755,7 +808,7 @@ long build_tree(double **pts, MPI_Comm team, node_t **nodes, long my_set, long t
     MPI_Bcast(&center_proc, 1, MPI_INT, 0, team);
 
     long left = node_id + 1;
-    long right = node_id + 2 * (team_set / 2);
+    long right = node_id + 1 + tree_nodes(team_set / 2, leaf_size);
 
     /* Add new node to leader's list */
     if (!id) {
@@ -916,28 +969,183 @@ long build_tree(double **pts, MPI_Comm team, node_t **nodes, long my_set, long t
 
 #pragma region print
 
-void print_node(node_t *node)
+#define DUMP_CHUNK 65536
+
+enum DUMP_PASSES {
+    RECORDS = 0,
+    CENTERS = 1,
+    LINES = 2,
+    POINTS = 3
+};
+
+/* Added to the local positions in the bucket leaves, see dump_tree */
+long point_offset = 0;
+
+/* Text output of the leader */
+tree_writer_t *writer;
+
+void print_node(tree_record_t *record, double *center)
 {
-    printf("%ld %ld %ld %lf",
-           node->id,
-           node->left,
-           node->right,
-           node->radius);
+    writer_node(writer, record->id, record->left, record->right, record->radius, center);
+}
 
-    for (long i = 0; i < n_dims - 1; i++)
-    {
-        printf(" %lf", node->center[i]);
+/* Lists this processor's nodes, its array of nodes first, then the list */
+long collect_nodes(long n_nodes, node_t *nodes, node_t ***all)
+{
+    long count = 0;
+
+    if (nodes) {
+        count = n_nodes;
+        for (node_t *aux = nodes->next; aux != NULL; aux = aux->next)
+            count++;
     }
-    printf(" \n");
-    fflush(stdout);
+
+    *all = (node_t **)malloc((count + 1) * sizeof(node_t *));
+    assert(*all);
+    if (nodes) {
+        count = 0;
+        for (long i = 0; i < n_nodes; i++)
+            (*all)[count++] = &nodes[i];
+        for (node_t *aux = nodes->next; aux != NULL; aux = aux->next)
+            (*all)[count++] = aux;
+    }
+
+    return count;
 }
 
+/* Bytes per node sent in each pass; a line is a record followed by its center */
+size_t pass_size(int pass)
+{
+    switch (pass) {
+        case RECORDS:
+            return sizeof(tree_record_t);
+        case CENTERS:
+        case POINTS:
+            return (n_dims - 1) * sizeof(double);
+        default:
+            return sizeof(tree_record_t) + (n_dims - 1) * sizeof(double);
+    }
+}
+
+void pack_nodes(node_t **all, long first, long n, int pass, char *buffer)
+{
+    size_t size = pass_size(pass);
+
+    if (pass == POINTS) {
+        memcpy(buffer, &bucket_pts[first * (n_dims - 1)], n * size);
+        return;
+    }
+    for (long i = 0; i < n; i++) {
+        node_t *node = all[first + i];
+        char *unit = &buffer[i * size];
+        if (pass != CENTERS) {
+            tree_record_t *record = (tree_record_t *)unit;
+            record->id = node->id;
+            record->left = node->left;
+            record->right = node->right;
+            record->radius = node->radius;
+            if (leaf_size > 1 && node->left < 0) {
+                record->left = node->left - point_offset;
+            }
+            unit += sizeof(tree_record_t);
+        }
+        if (pass != RECORDS) {
+            memcpy(unit, node->center, (n_dims - 1) * sizeof(double));
+        }
+    }
+}
+
+void output_nodes(char *buffer, long n, int pass)
+{
+    size_t size = pass_size(pass);
+
+    if (pass != LINES) {
+        fwrite(buffer, size, n, stdout);
+        return;
+    }
+    for (long i = 0; i < n; i++) {
+        print_node((tree_record_t *)&buffer[i * size], (double *)&buffer[i * size + sizeof(tree_record_t)]);
+    }
+}
+
+/* The leader writes every processor's nodes, in rank order: mpirun forwards
+ * each processor's stdout on its own, so their output would interleave.
+ * Ranks also hold consecutive subtrees, so bucket points are numbered, and
+ * written, in rank order too */
 void dump_tree(long n_nodes, node_t *nodes)
 {
-    for (long i = 0; i < n_nodes; i++)
-        print_node(&nodes[i]);
-    for (node_t *aux = nodes->next; aux != NULL; aux = aux->next)
-        print_node(aux);
+    node_t **all;
+    long count = collect_nodes(n_nodes, nodes, &all);
+    long remote, n;
+    int passes[3], n_passes = 0;
+
+    MPI_Exscan(&n_bucket_pts, &point_offset, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (!id) {
+        point_offset = 0;
+    }
+
+    if (format == FORMAT_BIN) {
+        /* All records, then all centers, then the points of bucket leaves */
+        passes[n_passes++] = RECORDS;
+        passes[n_passes++] = CENTERS;
+        if (leaf_size > 1) {
+            passes[n_passes++] = POINTS;
+        }
+    } else {
+        passes[n_passes++] = LINES;
+    }
+
+    char *buffer = (char *)malloc(DUMP_CHUNK * pass_size(LINES));
+    assert(buffer);
+    if (!id && format == FORMAT_TEXT) {
+        /* the header is already out, the index coordinate is left out */
+        writer = writer_open(stdout, n_dims - 1);
+        assert(writer);
+    }
+
+    for (int i = 0; i < n_passes; i++) {
+        int pass = passes[i];
+        size_t size = pass_size(pass);
+
+        if (pass == POINTS) {
+            int64_t total = n_points;
+
+            count = n_bucket_pts;
+            if (!id) {
+                fwrite(&total, sizeof(total), 1, stdout);
+            }
+        }
+
+        if (!id) {
+            for (long first = 0; first < count; first += n) {
+                n = count - first < DUMP_CHUNK ? count - first : DUMP_CHUNK;
+                pack_nodes(all, first, n, pass, buffer);
+                output_nodes(buffer, n, pass);
+            }
+            for (int p = 1; p < n_procs; p++) {
+                MPI_Recv(&remote, 1, MPI_LONG, p, DUMP, MPI_COMM_WORLD, &status);
+                for (long first = 0; first < remote; first += n) {
+                    n = remote - first < DUMP_CHUNK ? remote - first : DUMP_CHUNK;
+                    MPI_Recv(buffer, n * size, MPI_BYTE, p, DUMP, MPI_COMM_WORLD, &status);
+                    output_nodes(buffer, n, pass);
+                }
+            }
+        } else {
+            MPI_Send(&count, 1, MPI_LONG, 0, DUMP, MPI_COMM_WORLD);
+            for (long first = 0; first < count; first += n) {
+                n = count - first < DUMP_CHUNK ? count - first : DUMP_CHUNK;
+                pack_nodes(all, first, n, pass, buffer);
+                MPI_Send(buffer, n * size, MPI_BYTE, 0, DUMP, MPI_COMM_WORLD);
+            }
+        }
+    }
+    if (writer) {
+        writer_close(writer);
+    }
+    fflush(stdout);
+
+    free(buffer);
+    free(all);
 }
 
 #pragma endregion print
@@ -948,8 +1156,28 @@ int main(int argc, char *argv[])
 
     MPI_Init(&argc, &argv);
 
-    if (argc != 4) {
-        printf("Usage: %s <n_dims> <n_points> <seed>\n", argv[0]);
+    if (argc < 4) {
+        printf("Usage: %s <n_dims> <n_points> <seed> [--format=text|bin] [--points=uniform|clustered|duplicates] [--leaf-size=B] [--low-memory]\n", argv[0]);
+        exit(1);
+    }
+    for (int i = 4; i < argc; i++) {
+        long value;
+
+        if ((value = parse_leaf_size(argv[i])) >= 0) {
+            leaf_size = value;
+        } else if (strcmp(argv[i], "--low-memory") == 0) {
+            /* Selection already swaps the point pointers in place */
+        } else if (parse_distribution(argv[i]) < 0 && (format = parse_format(argv[i])) < 0) {
+            printf("Usage: %s <n_dims> <n_points> <seed> [--format=text|bin] [--points=uniform|clustered|duplicates] [--leaf-size=B] [--low-memory]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (leaf_size < 1) {
+        printf("Illegal leaf size, must be above 0.\n");
+        exit(1);
+    }
+    if (leaf_size > 1 && format == FORMAT_TEXT) {
+        printf("Bucket leaves (--leaf-size above 1) need --format=bin.\n");
         exit(1);
     }
 
@@ -971,7 +1199,10 @@ int main(int argc, char *argv[])
     MPI_Comm_split(MPI_COMM_WORLD, id < n_points, id, &comm);
 
     if (!id) {
-        printf("%d %ld\n", n_dims, 2 * n_points - 1);
+        if (format == FORMAT_BIN)
+            write_tree_header(stdout, n_dims, tree_nodes(n_points, leaf_size), leaf_size > 1 ? TREE_BUCKETS : 0);
+        else
+            printf("%d %ld\n", n_dims, 2 * n_points - 1);
     }
 
     double **pts = NULL;
@@ -1014,23 +1245,10 @@ int main(int argc, char *argv[])
         fprintf(stderr, "%.1f\n", exec_time);
     }
 
-    int send = PRINT, recv;
     /* print */
-    if (n_procs < 2) {
-        dump_tree(n_nodes, nodes);
-    } else if (!id) {
-        if (nodes) dump_tree(n_nodes, nodes);
-        fflush(stdout);
-        MPI_Send(&send, 1, MPI_INT, 1, 1, MPI_COMM_WORLD);
-        MPI_Recv(&recv, 1, MPI_INT, n_procs - 1, 0, MPI_COMM_WORLD, &status);
-    } else {
-        MPI_Recv(&recv, 1, MPI_INT, id - 1, id, MPI_COMM_WORLD, &status);
-        if (nodes) dump_tree(n_nodes, nodes);
-        fflush(stdout);
-        MPI_Send(&send, 1, MPI_INT, (id + 1) % n_procs, (id + 1) % n_procs, MPI_COMM_WORLD);
-    }
-
+    dump_tree(n_nodes, nodes);
 
     if (nodes) free_list(nodes);
+    free(bucket_pts);
     MPI_Finalize();
 }
@@ -1,88 +1,226 @@
+#define _GNU_SOURCE
 #include <omp.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "gen_points.h"
+#include "tree_io.h"
+#include "kernels.h"
+#include "tree_writer.h"
 
 int n_dims;
 long n_points;
-long max_depth = 0;
-long diff = 0;
+int format = FORMAT_TEXT;
+int layout = LAYOUT_ID;
 
-typedef struct _node
+/* Subtrees of at least TASK_MIN points are built as tasks, which idle
+ * threads steal; smaller ones are built by the thread that reaches them */
+#define TASK_MIN 4096
+
+/* Nodes of at least par_min points, more than one thread's share, split
+ * their sweeps into tasks of PAR_GRAIN points that idle threads pick up */
+#define PAR_GRAIN 32768
+long par_min = LONG_MAX;
+
+/* NUMA mode: each thread first touches a block of every array, and once the
+ * nodes above par_min are built, the subtrees below it are built by the
+ * thread whose block holds them instead of being left to the tasks */
+int numa = 0;
+long defer_below = 0;
+
+typedef struct _subtree
 {
+    long l;
+    long r;
     long id;
-    double *center;
-    double radius;
-    struct _node *L;
-    struct _node *R;
-} node_t;
+} subtree_t;
+
+subtree_t *pending;
+long n_pending = 0;
+
+/* Nodes are laid out implicitly by preorder id: a node over m points has its
+ * left child, over m / 2 of them, at id + 1 and its right child after the
+ * left subtree, and is a leaf when m is at most leaf_size (see tree_io.h).
+ * Only the radii and centers are stored, both indexed by id */
+long leaf_size = 1;
+long n_nodes;
+double *radii;
+double *centers;
 
 #pragma region math
 
-double quick_distance(double *pt1, double *pt2)
+/* Points are stored dimension-major: coordinate d of the point at position i
+ * is pts[d * n_points + i]. Every node owns a contiguous range of positions,
+ * so the sweeps below are unit-stride */
+double *pts;
+long *ids;          /* original index of the point at each position */
+long *perm;         /* positions in selection order */
+double *keys;       /* projection of the point at perm[i] onto ab, as a scalar;
+                       also the output of the distance sweeps */
+double *scratch;    /* gather buffers for apply_permutation */
+long *id_scratch;
+
+/* Low-memory mode swaps the points themselves during selection, so perm and
+ * the gather buffers aren't allocated; a little slower */
+int low_memory = 0;
+
+/* Copies the point at position i of a dimension-major array into p */
+void get_point(double *soa, long i, double *p)
 {
-    double dist = 0.0;
-
     for (int d = 0; d < n_dims; d++)
-        dist += (pt1[d] - pt2[d]) * (pt1[d] - pt2[d]);
-    return dist;
+    {
+        p[d] = soa[d * n_points + i];
+    }
 }
 
-double distance(double *pt1, double *pt2)
+/* Squared distance from p to every point in l..r, saved in out[l..r] */
+void sweep_distances(double *p, long l, long r, double *out)
 {
-    double dist = 0.0;
+    distance_kernel(pts, n_points, n_dims, p, l, r, out);
+}
 
-    for (int d = 0; d < n_dims; d++)
-        dist += (pt1[d] - pt2[d]) * (pt1[d] - pt2[d]);
-    return sqrt(dist);
+/* Last position of the task chunk starting at c */
+long chunk_end(long c, long r)
+{
+    return c + PAR_GRAIN - 1 < r ? c + PAR_GRAIN - 1 : r;
 }
 
-void mean(double *pt1, double *pt2, double *mean)
+/* Largest squared distance of a sweep and the first position holding it;
+ * pos is -1 while none is above zero */
+typedef struct _max_loc
 {
-    for (long i = 0; i < n_dims; i++)
+    double dist;
+    long pos;
+} max_loc_t;
+
+max_loc_t max_loc(max_loc_t x, max_loc_t y)
+{
+    return y.dist > x.dist || (y.dist == x.dist && y.pos < x.pos) ? y : x;
+}
+
+#pragma omp declare reduction(max_loc : max_loc_t : omp_out = max_loc(omp_out, omp_in)) \
+    initializer(omp_priv = (max_loc_t){0.0, -1})
+
+/* The one of positions i and j whose point has the smaller original index */
+long first_of(long i, long j)
+{
+    return ids[j] < ids[i] ? j : i;
+}
+
+#pragma omp declare reduction(first_of : long : omp_out = first_of(omp_out, omp_in)) \
+    initializer(omp_priv = omp_orig)
+
+max_loc_t scan_max(long l, long r)
+{
+    max_loc_t found = {0.0, -1};
+
+    for (long i = l; i < r + 1; i++)
     {
-        mean[i] = (pt1[i] + pt2[i]) / 2;
+        if (keys[i] > found.dist)
+        {
+            found.dist = keys[i];
+            found.pos = i;
+        }
     }
+    return found;
 }
 
-void get_furthest_points(double **pts, long l, long r, double **a, double **b)
+/* Sweeps the squared distances from p to l..r into keys and returns the largest */
+max_loc_t furthest_from(double *p, long l, long r)
 {
-    long i;
-    double dist, max_distance = 0.0;
+    max_loc_t found = {0.0, -1};
 
-    /* finds first point relative to the original set */
-    *b = pts[l];
-    for (i = l + 1; i < r + 1; i++)
+    if (r - l + 1 < par_min)
     {
-        *b = pts[i] < *b ? pts[i] : *b;
+        sweep_distances(p, l, r, keys);
+        return scan_max(l, r);
     }
 
-    /* Lock b as first point in set and find a */
-    for (i = l; i < r + 1; i++)
+#pragma omp taskloop grainsize(1) reduction(max_loc : found)
+    for (long c = l; c < r + 1; c += PAR_GRAIN)
+    {
+        sweep_distances(p, c, chunk_end(c, r), keys);
+        found = max_loc(found, scan_max(c, chunk_end(c, r)));
+    }
+    return found;
+}
+
+/* Position of the point with the smallest original index in l..r */
+long first_point(long l, long r)
+{
+    long first = l;
+
+    if (r - l + 1 < par_min)
     {
-        if ((dist = quick_distance(*b, pts[i])) > max_distance)
+        for (long i = l + 1; i < r + 1; i++)
         {
-            *a = pts[i];
-            max_distance = dist;
+            first = first_of(first, i);
         }
+        return first;
     }
 
-    max_distance = 0.0;
+#pragma omp taskloop grainsize(1) reduction(first_of : first)
+    for (long c = l; c < r + 1; c += PAR_GRAIN)
+    {
+        for (long i = c; i < chunk_end(c, r) + 1; i++)
+        {
+            first = first_of(first, i);
+        }
+    }
+    return first;
+}
 
-    /* Find b */
-    for (i = l; i < r + 1; i++)
+void mean(double *pt1, double *pt2, double *mean)
+{
+    for (long i = 0; i < n_dims; i++)
+    {
+        mean[i] = (pt1[i] + pt2[i]) / 2;
+    }
+}
+
+/* Mean of the points in l..r, the center of a bucket leaf */
+void centroid(long l, long r, double *center)
+{
+    for (int d = 0; d < n_dims; d++)
     {
-        if ((dist = quick_distance(*a, pts[i])) > max_distance)
+        double *x = &pts[d * n_points];
+        double sum = 0.0;
+
+        for (long i = l; i < r + 1; i++)
         {
-            *b = pts[i];
-            max_distance = dist;
+            sum += x[i];
         }
+        center[d] = sum / (r - l + 1);
     }
 }
 
+/* Positions of the furthest points a and b in l..r */
+void get_furthest_points(long l, long r, long *a, long *b)
+{
+    max_loc_t found;
+    double p[n_dims];
+
+    /* finds first point relative to the original set */
+    *b = first_point(l, r);
+
+    /* Lock b as first point in set and find a */
+    get_point(pts, *b, p);
+    found = furthest_from(p, l, r);
+    *a = found.pos < 0 ? *b : found.pos;
+
+    /* Find b */
+    get_point(pts, *a, p);
+    found = furthest_from(p, l, r);
+    *b = found.pos < 0 ? *b : found.pos;
+}
+
 /* Subtracts p2 from p1 and saves in result */
 void sub_points(double *p1, double *p2, double *result)
 {
@@ -130,255 +268,806 @@ void mul_point(double *p1, double constant, double *result)
     }
 }
 
-/* Projects p onto ab */
-void project(double *p, double *a, double *b_a, double *common_factor, double *result)
+/* Projects every point in l..r onto ab, as keys[i] * key_factor relative to a */
+void project(long l, long r, double *a, double *key_factor)
 {
-    double product;
-
-    sub_points(p, a, result);
-    product = inner_product(result, common_factor);
-
-    mul_point(b_a, product, result);
-}
-
-#pragma endregion
-
-#pragma region qselect
+    if (r - l + 1 < par_min)
+    {
+        project_kernel(pts, n_points, n_dims, a, key_factor, l, r, keys);
+        return;
+    }
 
-#define SWAP(x, y)         \
-    {                      \
-        double *temp1 = x; \
-        x = y;             \
-        y = temp1;         \
+#pragma omp taskloop grainsize(1)
+    for (long c = l; c < r + 1; c += PAR_GRAIN)
+    {
+        project_kernel(pts, n_points, n_dims, a, key_factor, c, chunk_end(c, r), keys);
     }
+}
 
-int less_than(double *p1, double *p2)
+/* The projections are b_a * t, so their lexicographic order is the order of
+ * t times the sign of b_a's first nonzero coordinate; keys hold that product */
+double key_sign(double *b_a)
 {
-    for (long i = 0; i < n_dims; i++)
+    for (int d = 0; d < n_dims; d++)
     {
-        if (p1[i] < p2[i])
+        if (b_a[d] > 0)
         {
-            return 1;
+            return 1.0;
         }
-        else if (p1[i] > p2[i])
+        else if (b_a[d] < 0)
         {
-            return 0;
+            return -1.0;
         }
     }
-    return 0;
+    return 1.0;
 }
 
-long median_of_three(double **pts, double **projs, long l, long r)
+/* apply_permutation for large nodes: every pass is split into tasks, and
+ * a range is only overwritten once all of it has been gathered */
+void apply_permutation_tasks(long l, long r)
 {
-    long m = (l + r) / 2;
-    if (less_than(projs[r], projs[l]))
+    for (int d = 0; d < n_dims; d++)
     {
-        SWAP(projs[r], projs[l]);
-        SWAP(pts[r], pts[l]);
+        double *x = &pts[d * n_points];
+
+#pragma omp taskloop grainsize(1)
+        for (long c = l; c < r + 1; c += PAR_GRAIN)
+        {
+            for (long i = c; i < chunk_end(c, r) + 1; i++)
+            {
+                scratch[i] = x[perm[i]];
+            }
+        }
+#pragma omp taskloop grainsize(1)
+        for (long c = l; c < r + 1; c += PAR_GRAIN)
+        {
+            memcpy(&x[c], &scratch[c], (chunk_end(c, r) - c + 1) * sizeof(double));
+        }
     }
-    if (less_than(projs[m], projs[l]))
+
+#pragma omp taskloop grainsize(1)
+    for (long c = l; c < r + 1; c += PAR_GRAIN)
     {
-        SWAP(projs[m], projs[l]);
-        SWAP(pts[m], pts[l]);
+        for (long i = c; i < chunk_end(c, r) + 1; i++)
+        {
+            id_scratch[i] = ids[perm[i]];
+        }
     }
-    if (less_than(projs[r], projs[m]))
+#pragma omp taskloop grainsize(1)
+    for (long c = l; c < r + 1; c += PAR_GRAIN)
     {
-        SWAP(projs[r], projs[m]);
-        SWAP(pts[r], pts[m]);
+        memcpy(&ids[c], &id_scratch[c], (chunk_end(c, r) - c + 1) * sizeof(long));
     }
-    return m;
 }
 
-long partition(double **pts, double **projs, long l, long r, long pivotIndex)
+/* Moves the points in l..r into the order left in perm by the selection */
+void apply_permutation(long l, long r)
 {
-    double *pivotValue = projs[pivotIndex];
+    long i;
 
-    SWAP(projs[pivotIndex], projs[r]);
-    SWAP(pts[pivotIndex], pts[r]);
-    long storeIndex = l;
+    if (r - l + 1 >= par_min)
+    {
+        apply_permutation_tasks(l, r);
+        return;
+    }
 
-    for (long i = l; i < r; i++)
+    for (int d = 0; d < n_dims; d++)
     {
-        if (less_than(projs[i], pivotValue))
+        double *x = &pts[d * n_points];
+
+        for (i = l; i < r + 1; i++)
         {
-            SWAP(projs[storeIndex], projs[i]);
-            SWAP(pts[storeIndex], pts[i]);
-            storeIndex++;
+            scratch[i] = x[perm[i]];
         }
+        memcpy(&x[l], &scratch[l], (r - l + 1) * sizeof(double));
+    }
+
+    for (i = l; i < r + 1; i++)
+    {
+        id_scratch[i] = ids[perm[i]];
     }
+    memcpy(&ids[l], &id_scratch[l], (r - l + 1) * sizeof(long));
+}
+
+/* Exchanges the points at positions i and j, all coordinates and the index */
+void swap_points(long i, long j)
+{
+    long temp_id = ids[i];
 
-    SWAP(projs[r], projs[storeIndex]);
-    SWAP(pts[r], pts[storeIndex]);
+    ids[i] = ids[j];
+    ids[j] = temp_id;
+    for (int d = 0; d < n_dims; d++)
+    {
+        double *x = &pts[d * n_points];
+        double temp_x = x[i];
 
-    return storeIndex;
+        x[i] = x[j];
+        x[j] = temp_x;
+    }
 }
 
-double *qselect(double **pts, double **projs, long l, long r, long k)
+#pragma endregion
+
+#pragma region qselect
+
+/* Selection permutes the keys and their positions in perm together, the
+ * points stay in place; in low-memory mode the points move with the keys */
+#define SWAP(i, j)                   \
+    {                                \
+        double temp_key = keys[i];   \
+        keys[i] = keys[j];           \
+        keys[j] = temp_key;          \
+        if (low_memory)              \
+        {                            \
+            swap_points(i, j);       \
+        }                            \
+        else                         \
+        {                            \
+            long temp_pos = perm[i]; \
+            perm[i] = perm[j];       \
+            perm[j] = temp_pos;      \
+        }                            \
+    }
+
+#define SELECT_KEY(i) keys[i]
+#define SELECT_SWAP(i, j) SWAP(i, j)
+#include "qselect.h"
+
+#define SELECT_SAMPLE 1024 /* keys sampled by select_kth_tasks to bracket the k-th */
+#define SELECT_BAND 32     /* sample ranks kept on each side of the k-th's estimate */
+
+int compare_keys(const void *x, const void *y)
 {
-    /* This way of doing it uses less stack */
-    while (1)
+    double key_x = *(const double *)x, key_y = *(const double *)y;
+
+    return (key_x > key_y) - (key_x < key_y);
+}
+
+/* 0 below the band lo..hi, 1 within and 2 above */
+int key_class(double key, double lo, double hi)
+{
+    return (key >= lo) + (key > hi);
+}
+
+/* select_kth for large nodes. A band of keys around the k-th is taken from a
+ * sample, and every pass splits the range into the keys below, within and
+ * above it: the three are counted per chunk, then the keys and positions are
+ * scattered through the gather buffers in chunk order, so the result doesn't
+ * depend on the threads. The range narrows to the part holding k, and what
+ * is left goes to select_kth once it is small or stops shrinking */
+double select_kth_tasks(long l, long r, long k)
+{
+    while (r - l + 1 >= par_min)
     {
-        if (l == r)
+        long n = r - l + 1, n_chunks = (n + PAR_GRAIN - 1) / PAR_GRAIN;
+        long est = (k - l) * SELECT_SAMPLE / n;
+        long counts[n_chunks][3], start[3], below = 0, within = 0;
+        double sample[SELECT_SAMPLE], lo, hi;
+
+        for (long s = 0; s < SELECT_SAMPLE; s++)
+        {
+            sample[s] = keys[l + s * (n / SELECT_SAMPLE)];
+        }
+        qsort(sample, SELECT_SAMPLE, sizeof(double), compare_keys);
+        lo = sample[est > SELECT_BAND ? est - SELECT_BAND : 0];
+        hi = sample[est + SELECT_BAND < SELECT_SAMPLE ? est + SELECT_BAND : SELECT_SAMPLE - 1];
+
+#pragma omp taskloop grainsize(1) shared(counts)
+        for (long c = 0; c < n_chunks; c++)
+        {
+            long c_l = l + c * PAR_GRAIN;
+
+            counts[c][0] = counts[c][1] = counts[c][2] = 0;
+            for (long i = c_l; i < chunk_end(c_l, r) + 1; i++)
+            {
+                counts[c][key_class(keys[i], lo, hi)]++;
+            }
+        }
+
+        /* Turn the counts into where each chunk writes each part */
+        for (long c = 0; c < n_chunks; c++)
+        {
+            below += counts[c][0];
+            within += counts[c][1];
+        }
+        start[0] = l;
+        start[1] = l + below;
+        start[2] = l + below + within;
+        for (long c = 0; c < n_chunks; c++)
+        {
+            for (int part = 0; part < 3; part++)
+            {
+                long count = counts[c][part];
+
+                counts[c][part] = start[part];
+                start[part] += count;
+            }
+        }
+
+#pragma omp taskloop grainsize(1) shared(counts)
+        for (long c = 0; c < n_chunks; c++)
+        {
+            long c_l = l + c * PAR_GRAIN;
+
+            for (long i = c_l; i < chunk_end(c_l, r) + 1; i++)
+            {
+                long to = counts[c][key_class(keys[i], lo, hi)]++;
+
+                scratch[to] = keys[i];
+                id_scratch[to] = perm[i];
+            }
+        }
+#pragma omp taskloop grainsize(1)
+        for (long c = l; c < r + 1; c += PAR_GRAIN)
+        {
+            memcpy(&keys[c], &scratch[c], (chunk_end(c, r) - c + 1) * sizeof(double));
+            memcpy(&perm[c], &id_scratch[c], (chunk_end(c, r) - c + 1) * sizeof(long));
+        }
+
+        if (k < l + below)
         {
-            return projs[l];
+            r = l + below - 1;
         }
-        long pivotIndex = median_of_three(pts, projs, l, r);
-        pivotIndex = partition(pts, projs, l, r, pivotIndex);
-        if (k == pivotIndex)
+        else if (k >= l + below + within)
         {
-            return projs[k];
+            l = l + below + within;
         }
-        else if (k < pivotIndex)
+        else if (lo == hi)
         {
-            r = pivotIndex - 1;
+            /* k landed among keys all equal to lo */
+            return lo;
+        }
+        else if (within == n)
+        {
+            break;
         }
         else
         {
-            l = pivotIndex + 1;
+            r = l + below + within - 1;
+            l = l + below;
         }
     }
+    return select_kth(l, r, k);
 }
 
-/* Computes the median point of a set of points in a line */
-long median(double **pts, double **projs, long l, long r, double *center_pt)
+/* Largest key in l..r */
+double max_key(long l, long r)
+{
+    double current = keys[l];
+
+    if (r - l + 1 < par_min)
+    {
+        for (long i = l + 1; i < r + 1; i++)
+        {
+            if (current < keys[i])
+            {
+                current = keys[i];
+            }
+        }
+        return current;
+    }
+
+#pragma omp taskloop grainsize(1) reduction(max : current)
+    for (long c = l; c < r + 1; c += PAR_GRAIN)
+    {
+        for (long i = c; i < chunk_end(c, r) + 1; i++)
+        {
+            current = current < keys[i] ? keys[i] : current;
+        }
+    }
+    return current;
+}
+
+/* Computes the median point of a set of points in a line; only the
+ * projection of the median itself becomes a vector, b_a * key * sign.
+ * Large nodes select with tasks, except in low-memory mode, which has no
+ * buffers to scatter through */
+long median(long l, long r, double *b_a, double sign, double *center_pt)
 {
     long projs_size = (r - l + 1);
     long k = projs_size / 2;
+    int tasks = !low_memory && projs_size >= par_min;
+
+    if (tasks)
+    {
+#pragma omp taskloop grainsize(1)
+        for (long c = l; c < r + 1; c += PAR_GRAIN)
+        {
+            for (long i = c; i < chunk_end(c, r) + 1; i++)
+            {
+                perm[i] = i;
+            }
+        }
+    }
+    else
+    {
+        for (long i = l; !low_memory && i < r + 1; i++)
+        {
+            perm[i] = i;
+        }
+    }
 
     if (projs_size % 2 != 0)
     {
-        memcpy(center_pt, qselect(pts, projs, l, r, k + l), sizeof(double) * n_dims);
+        mul_point(b_a, (tasks ? select_kth_tasks(l, r, k + l) : select_kth(l, r, k + l)) * sign, center_pt);
     }
     else
     {
-        qselect(pts, projs, l, r, k + l);
+        double kth = tasks ? select_kth_tasks(l, r, k + l) : select_kth(l, r, k + l);
 
         /* Finds point immediately before kth point */
-        double *current = projs[l];
-        for (long i = l + 1; i < k + l; i++)
+        double current = max_key(l, k + l - 1);
+        double before[n_dims], after[n_dims];
+        mul_point(b_a, current * sign, before);
+        mul_point(b_a, kth * sign, after);
+        mean(before, after, center_pt);
+    }
+    k--;
+    return k;
+}
+
+#pragma endregion
+
+#pragma region print
+
+/* Center of node id */
+double *node_center(long id)
+{
+    return &centers[id * n_dims];
+}
+
+/* The text is cut into segments, formatted by all threads a round at a time
+ * and written in order: a subtree of at most SEGMENT_POINTS points, or the
+ * line of a node above those, which comes after its children's */
+#define SEGMENT_POINTS 16384
+
+typedef struct _segment
+{
+    long id;
+    long size;
+    int whole;  /* the subtree, or the node's line only */
+} segment_t;
+
+typedef struct _text
+{
+    char *bytes;
+    size_t used;
+    size_t capacity;
+} text_t;
+
+segment_t *segments;
+long n_segments;
+
+void list_segments(long id, long size)
+{
+    if (size <= SEGMENT_POINTS || size <= leaf_size)
+    {
+        segments[n_segments++] = (segment_t){id, size, 1};
+        return;
+    }
+    list_segments(left_child(id, size, leaf_size), size / 2);
+    list_segments(right_child(id, size, leaf_size), size - size / 2);
+    segments[n_segments++] = (segment_t){id, size, 0};
+}
+
+void print_node(text_t *text, long id, long size)
+{
+    if (text->used + NODE_TEXT_MAX(n_dims) > text->capacity)
+    {
+        text->capacity = 2 * text->capacity + NODE_TEXT_MAX(n_dims);
+        text->bytes = (char *)realloc(text->bytes, text->capacity);
+        assert(text->bytes);
+    }
+    text->used = format_node(&text->bytes[text->used], id,
+                             left_child(id, size, leaf_size), right_child(id, size, leaf_size),
+                             radii[id], node_center(id), n_dims) - text->bytes;
+}
+
+void print_subtree(text_t *text, long id, long size)
+{
+    if (size > leaf_size)
+    {
+        print_subtree(text, left_child(id, size, leaf_size), size / 2);
+        print_subtree(text, right_child(id, size, leaf_size), size - size / 2);
+    }
+    print_node(text, id, size);
+}
+
+void write_failed(void)
+{
+    perror("Error writing tree");
+    exit(1);
+}
+
+/* Writes n texts in order, from offset on in a file; each thread puts its
+ * texts in place with pwrite. Pipes and files opened for appending can't be
+ * written at an offset, so there one writev takes them all. Returns the
+ * offset after the texts */
+off_t write_texts(int fd, text_t *texts, int n, off_t offset, int seekable)
+{
+    off_t starts[n];
+    struct iovec parts[n];
+    int first = 0;
+
+    for (int t = 0; t < n; t++)
+    {
+        starts[t] = offset;
+        offset += texts[t].used;
+        parts[t].iov_base = texts[t].bytes;
+        parts[t].iov_len = texts[t].used;
+    }
+
+    if (seekable)
+    {
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int t = 0; t < n; t++)
         {
-            if (less_than(current, projs[i]))
+            for (size_t done = 0; done < texts[t].used;)
             {
-                current = projs[i];
+                ssize_t written = pwrite(fd, texts[t].bytes + done, texts[t].used - done, starts[t] + done);
+
+                if (written < 0)
+                {
+                    write_failed();
+                }
+                done += written;
             }
         }
-        mean(current, projs[k + l], center_pt);
+        return offset;
     }
-    k--;
-    return k;
+
+    while (first < n)
+    {
+        ssize_t written = writev(fd, &parts[first], n - first < IOV_MAX ? n - first : IOV_MAX);
+
+        if (written < 0)
+        {
+            write_failed();
+        }
+        for (; first < n && (size_t)written >= parts[first].iov_len; first++)
+        {
+            written -= parts[first].iov_len;
+        }
+        if (first < n)
+        {
+            parts[first].iov_base = (char *)parts[first].iov_base + written;
+            parts[first].iov_len -= written;
+        }
+    }
+    return offset;
 }
 
-#pragma endregion
+void dump_tree(void)
+{
+    int fd = fileno(stdout);
+    int n_texts = 4 * omp_get_max_threads();
+    text_t *texts = (text_t *)calloc(n_texts, sizeof(text_t));
+    assert(texts);
+    segments = (segment_t *)malloc((4 * (n_points / SEGMENT_POINTS) + 4) * sizeof(segment_t));
+    assert(segments);
+    n_segments = 0;
+    list_segments(0, n_points);
+
+    printf("%d %ld\n", n_dims, n_nodes);
+    fflush(stdout);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    int seekable = offset >= 0 && !(fcntl(fd, F_GETFL) & O_APPEND);
+
+    for (long first = 0; first < n_segments; first += n_texts)
+    {
+        int n = n_segments - first < n_texts ? n_segments - first : n_texts;
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int t = 0; t < n; t++)
+        {
+            segment_t *segment = &segments[first + t];
 
-node_t *build_tree(double **pts, double **projections, node_t *nodes, long l, long r, long depth, long id)
+            texts[t].used = 0;
+            if (segment->whole)
+            {
+                print_subtree(&texts[t], segment->id, segment->size);
+            }
+            else
+            {
+                print_node(&texts[t], segment->id, segment->size);
+            }
+        }
+        offset = write_texts(fd, texts, n, offset, seekable);
+    }
+
+    /* pwrite leaves the file offset where it was */
+    if (seekable)
+    {
+        lseek(fd, offset, SEEK_SET);
+    }
+
+    for (int t = 0; t < n_texts; t++)
+    {
+        free(texts[t].bytes);
+    }
+    free(texts);
+    free(segments);
+}
+
+/* Position i of the sorted points, for the binary writers */
+void sorted_point(long i, double *p)
+{
+    get_point(pts, i, p);
+}
+
+#pragma endregion print
+
+void build_tree(long l, long r, long id)
 {
+    double *center = node_center(id);
 
-    node_t *node = &nodes[id];
+    radii[id] = 0.0;
 
-    node->id = id;
-    node->radius = 0.0;
+    /* Left for its home thread, see build_tree_numa */
+    if (r - l + 1 < defer_below)
+    {
+        long slot;
+
+#pragma omp atomic capture
+        slot = n_pending++;
+        pending[slot] = (subtree_t){l, r, id};
+        return;
+    }
 
     /* It's a leaf */
     if (r - l == 0)
     {
-        node->center = pts[l];
-        node->L = NULL;
-        node->R = NULL;
-        return node;
+        get_point(pts, l, center);
+        return;
+    }
+
+    /* A bucket leaf keeps its points, inside a ball around their mean */
+    if (r - l + 1 <= leaf_size)
+    {
+        centroid(l, r, center);
+        radii[id] = sqrt(furthest_from(center, l, r).dist);
+        return;
     }
 
-    double *a, *b;
+    long a_pos, b_pos;
+
+    get_furthest_points(l, r, &a_pos, &b_pos);
 
-    get_furthest_points(pts, l, r, &a, &b);
+    double a[n_dims], b[n_dims];
+    get_point(pts, a_pos, a);
+    get_point(pts, b_pos, b);
 
     /* Compute common factors to all projections */
     double b_a[n_dims];
     sub_points(b, a, b_a);
     double denominator = inner_product(b_a, b_a);
     double common_factor[n_dims];
-    mul_point(b_a, 1 / denominator, common_factor);
+    /* All points coincide if a = b, then they all project onto a */
+    mul_point(b_a, denominator > 0 ? 1 / denominator : 0, common_factor);
 
-    /* Project points onto ab */
-    for (long i = l; i < r + 1; i++)
-    {
-        project(pts[i], a, b_a, common_factor, projections[i]);
-    }
+    /* Project points onto ab, keeping one scalar key per point */
+    double sign = key_sign(b_a);
+    double key_factor[n_dims];
+    mul_point(common_factor, sign, key_factor);
+    project(l, r, a, key_factor);
 
     /* Find median point and split; 2 in 1 GIGA FAST */
-    long split_index = median(pts, projections, l, r, node->center);
+    long split_index = median(l, r, b_a, sign, center);
 
     /* Since the projection skips summing a at the end it must be done here */
-    add_points(node->center, a, node->center);
+    add_points(center, a, center);
 
-    /* Compute radius */
-    for (long i = l; i < r + 1; i++)
+    /* Compute radius, sqrt is monotonic so only the largest is taken */
+    radii[id] = sqrt(furthest_from(center, l, r).dist);
+
+    /* Each child's points become contiguous, as leaves end up in memory order */
+    if (!low_memory)
     {
-        double dist = distance(node->center, pts[i]);
-        if (dist > node->radius)
-        {
-            node->radius = dist;
-        }
+        apply_permutation(l, r);
     }
 
-    if (depth < max_depth || (depth == max_depth && omp_get_thread_num() < diff))
+    /* The left child goes to a task and this thread carries on with the right */
+    if (r - l + 1 >= 2 * TASK_MIN)
     {
-#pragma omp taskgroup
-        {
 #pragma omp task
-            node->L = build_tree(pts, projections, nodes, l, l + split_index, depth + 1, id + 1);
-#pragma omp task
-            node->R = build_tree(pts, projections, nodes, l + split_index + 1, r, depth + 1, id + 2 * (split_index + 1));
-        }
+        build_tree(l, l + split_index, id + 1);
+        build_tree(l + split_index + 1, r, id + 1 + tree_nodes(split_index + 1, leaf_size));
+#pragma omp taskwait
     }
     else
     {
-        node->L = build_tree(pts, projections, nodes, l, l + split_index, depth + 1, id + 1);
-        node->R = build_tree(pts, projections, nodes, l + split_index + 1, r, depth + 1, id + 2 * (split_index + 1));
+        build_tree(l, l + split_index, id + 1);
+        build_tree(l + split_index + 1, r, id + 1 + tree_nodes(split_index + 1, leaf_size));
     }
+}
 
-    return node;
+
+#pragma region numa
+
+/* First of the positions in thread t's block of count */
+long block_start(long count, int t, int n_threads)
+{
+    return count * t / n_threads;
 }
 
-#pragma region print
+/* Zeroes thread t's block of each of the rows of count items of array */
+void touch_block(void *array, int rows, long count, size_t size, int t, int n_threads)
+{
+    long first = block_start(count, t, n_threads), last = block_start(count, t + 1, n_threads);
 
-void print_node(node_t *node)
+    for (int row = 0; array && row < rows; row++)
+    {
+        memset((char *)array + (row * count + first) * size, 0, (last - first) * size);
+    }
+}
+
+/* Socket of the CPU the calling thread runs on, 0 if unknown */
+int current_socket(void)
 {
-    if (node->L)
-        print_node(node->L);
-    if (node->R)
-        print_node(node->R);
+    char path[96];
+    int socket = 0, cpu = sched_getcpu();
+    FILE *fp;
+
+    if (cpu < 0)
+        return 0;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    if ((fp = fopen(path, "r")) != NULL)
+    {
+        if (fscanf(fp, "%d", &socket) != 1)
+            socket = 0;
+        fclose(fp);
+    }
+    return socket;
+}
 
-    printf("%ld %ld %ld %lf",
-           node->id,
-           node->L ? node->L->id : -1,
-           node->R ? node->R->id : -1,
-           node->radius);
+/* Sum of the placed points, kept so their timed read isn't optimized out */
+volatile double placed_sum;
 
-    for (long i = 0; i < n_dims; i++)
+/* Moves the points into an array whose pages each thread touches first,
+ * block by block, and does the same for the other arrays. The copy faults
+ * the pages in, so a second read of each thread's placed block is what gets
+ * timed, to report the bandwidth every socket reaches */
+void place_arrays(void)
+{
+    int max_threads = omp_get_max_threads(), n_threads = 1, n_sockets = 1;
+    int socket[max_threads];
+    double seconds[max_threads], bytes[max_threads], sums[max_threads];
+    double *placed = (double *)malloc(n_dims * n_points * sizeof(double));
+    assert(placed);
+
+#pragma omp parallel proc_bind(spread)
+    {
+        int t = omp_get_thread_num();
+        long first = block_start(n_points, t, omp_get_num_threads());
+        long last = block_start(n_points, t + 1, omp_get_num_threads());
+
+#pragma omp single
+        n_threads = omp_get_num_threads();
+
+        socket[t] = current_socket();
+        for (int d = 0; d < n_dims; d++)
+        {
+            memcpy(&placed[d * n_points + first], &pts[d * n_points + first], (last - first) * sizeof(double));
+        }
+
+        double sum = 0.0;
+        seconds[t] = -omp_get_wtime();
+        for (int d = 0; d < n_dims; d++)
+        {
+            for (long i = first; i < last; i++)
+            {
+                sum += placed[d * n_points + i];
+            }
+        }
+        seconds[t] += omp_get_wtime();
+        sums[t] = sum;
+        bytes[t] = (double)n_dims * (last - first) * sizeof(double);
+
+        touch_block(keys, 1, n_points, sizeof(double), t, n_threads);
+        touch_block(ids, 1, n_points, sizeof(long), t, n_threads);
+        touch_block(perm, 1, n_points, sizeof(long), t, n_threads);
+        touch_block(scratch, 1, n_points, sizeof(double), t, n_threads);
+        touch_block(id_scratch, 1, n_points, sizeof(long), t, n_threads);
+        /* Node ids are preorder, about twice the position of their points */
+        touch_block(radii, 1, n_nodes, sizeof(double), t, n_threads);
+        touch_block(centers, 1, n_nodes, n_dims * sizeof(double), t, n_threads);
+    }
+    free(pts);
+    pts = placed;
+
+    placed_sum = 0.0;
+    for (int t = 0; t < n_threads; t++)
     {
-        printf(" %lf", node->center[i]);
+        placed_sum += sums[t];
+        n_sockets = socket[t] + 1 > n_sockets ? socket[t] + 1 : n_sockets;
+    }
+    for (int s = 0; s < n_sockets; s++)
+    {
+        int threads = 0;
+        double socket_bytes = 0.0, socket_seconds = 0.0;
+
+        for (int t = 0; t < n_threads; t++)
+        {
+            if (socket[t] == s)
+            {
+                threads++;
+                socket_bytes += bytes[t];
+                socket_seconds = seconds[t] > socket_seconds ? seconds[t] : socket_seconds;
+            }
+        }
+        if (threads)
+            fprintf(stderr, "socket %d: %d threads, %.1f GB/s\n", s, threads,
+                    socket_seconds > 0 ? socket_bytes / socket_seconds / 1e9 : 0.0);
     }
-    printf(" \n");
 }
 
-void dump_tree(node_t *root)
+/* Builds the nodes above par_min with every thread, as build_tree does,
+ * then each thread builds the subtrees whose middle point is in its block */
+void build_tree_numa(void)
 {
-    printf("%d %ld\n", n_dims, 2 * n_points - 1);
-    print_node(root);
+    pending = (subtree_t *)malloc((4 * (n_points / par_min) + 4) * sizeof(subtree_t));
+    assert(pending);
+    defer_below = par_min;
+
+#pragma omp parallel proc_bind(spread)
+    {
+        int t = omp_get_thread_num(), n_threads = omp_get_num_threads();
+        long first = block_start(n_points, t, n_threads), last = block_start(n_points, t + 1, n_threads);
+
+#pragma omp single
+        build_tree(0, n_points - 1, 0);
+#pragma omp single
+        defer_below = 0;
+
+        for (long s = 0; s < n_pending; s++)
+        {
+            long middle = (pending[s].l + pending[s].r) / 2;
+
+            if (middle >= first && middle < last)
+            {
+                build_tree(pending[s].l, pending[s].r, pending[s].id);
+            }
+        }
+    }
+    free(pending);
 }
 
-#pragma endregion print
+#pragma endregion numa
 
 int main(int argc, char *argv[])
 {
     double exec_time = -omp_get_wtime();
-    double **pts = get_points(argc, argv, &n_dims, &n_points, 0, 0);
-    double *to_free = *pts;
-    node_t *root;
     unsigned seed;
 
-    if(argc != 4){
-        printf("Usage: %s <n_dims> <n_points> <seed>\n", argv[0]);
+    if(argc < 4){
+        printf("Usage: %s <n_dims> <n_points> <seed> [--format=text|bin] [--layout=id|veb] [--points=uniform|clustered|duplicates] [--leaf-size=B] [--low-memory] [--numa]\n", argv[0]);
+        exit(1);
+    }
+    for(int i = 4; i < argc; i++){
+        long value;
+
+        if(strcmp(argv[i], "--low-memory") == 0)
+            low_memory = 1;
+        else if((value = parse_leaf_size(argv[i])) >= 0)
+            leaf_size = value;
+        else if(strcmp(argv[i], "--numa") == 0)
+            numa = 1;
+        else if((value = parse_layout(argv[i])) >= 0)
+            layout = value;
+        else if((value = parse_format(argv[i])) >= 0)
+            format = value;
+        else if(parse_distribution(argv[i]) < 0){
+            printf("Usage: %s <n_dims> <n_points> <seed> [--format=text|bin] [--layout=id|veb] [--points=uniform|clustered|duplicates] [--leaf-size=B] [--low-memory] [--numa]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if(leaf_size < 1){
+        printf("Illegal leaf size, must be above 0.\n");
+        exit(1);
+    }
+    if(leaf_size > 1 && format == FORMAT_TEXT){
+        printf("Bucket leaves (--leaf-size above 1) need --format=bin.\n");
         exit(1);
     }
 
@@ -397,47 +1086,77 @@ int main(int argc, char *argv[])
     seed = atoi(argv[3]);
     srandom(seed);
 
-    max_depth = (int)log2(omp_get_max_threads());
-    /* If number of threads isn't a power of 2, the difference between
-     * 2 ^ max_depth and num_threads must be accounted or those threads
-     * won't be used
-     */
-    diff = omp_get_max_threads() - (1 << max_depth);
+    pts = get_points_soa(argc, argv, &n_dims, &n_points);
+    init_kernels(n_dims);
 
-    /* Allocate memory for projections */
-    double **projections = (double **)malloc(n_points * sizeof(double *));
-    double *proj = (double *)malloc(n_points * n_dims * sizeof(double));
-    for (long i = 0; i < n_points; i++)
+    if (omp_get_max_threads() > 1)
     {
-        projections[i] = &proj[i * n_dims];
+        par_min = n_points / omp_get_max_threads();
+        par_min = par_min < 2 * PAR_GRAIN ? 2 * PAR_GRAIN : par_min;
+    }
+
+    /* Allocate memory for the keys and the position permutations */
+    keys = (double *)malloc(n_points * sizeof(double));
+    assert(keys);
+    ids = (long *)malloc(n_points * sizeof(long));
+    assert(ids);
+    if (!low_memory)
+    {
+        perm = (long *)malloc(n_points * sizeof(long));
+        assert(perm);
+        scratch = (double *)malloc(n_points * sizeof(double));
+        assert(scratch);
+        id_scratch = (long *)malloc(n_points * sizeof(long));
+        assert(id_scratch);
     }
 
     /* Allocate memory for nodes */
-    node_t *nodes = (node_t *)malloc((2 * n_points - 1) * sizeof(node_t));
-    assert(nodes);
-    double *centers = (double *)malloc((2 * n_points - 1) * n_dims * sizeof(double));
+    n_nodes = tree_nodes(n_points, leaf_size);
+    radii = (double *)malloc(n_nodes * sizeof(double));
+    assert(radii);
+    centers = (double *)malloc(n_nodes * n_dims * sizeof(double));
     assert(centers);
 
-    for (long i = 0; i < 2 * n_points - 1; i++)
+    /* Pages go where they are first touched, so this comes before any writes */
+    if (numa)
     {
-        nodes[i].center = &centers[i * n_dims];
+        place_arrays();
     }
 
+    for (long i = 0; i < n_points; i++)
+    {
+        ids[i] = i;
+    }
+
+    if (numa)
+    {
+        build_tree_numa();
+    }
+    else
+    {
 #pragma omp parallel
 #pragma omp single
-    {
+        {
 #pragma omp task
-        root = build_tree(pts, projections, nodes, 0, n_points - 1, 0, 0);
+            build_tree(0, n_points - 1, 0);
+        }
     }
     exec_time += omp_get_wtime();
     fprintf(stderr, "%.1f\n", exec_time);
 
-    dump_tree(root);
+    if (format == FORMAT_TEXT)
+        dump_tree();
+    else if (layout == LAYOUT_VEB)
+        dump_tree_veb(stdout, n_dims, n_points, leaf_size, radii, centers, sorted_point);
+    else
+        dump_tree_bin(stdout, n_dims, n_points, leaf_size, radii, centers, sorted_point);
 
-    free(nodes);
+    free(radii);
     free(centers);
-    free(projections);
-    free(proj);
-    free(to_free);
+    free(keys);
+    free(scratch);
+    free(ids);
+    free(perm);
+    free(id_scratch);
     free(pts);
 }
@@ -5,38 +5,55 @@
 #include <assert.h>
 #include <string.h>
 #include "gen_points.h"
+#include "tree_io.h"
+#include "kernels.h"
+#include "tree_writer.h"
 
 int n_dims;
 long n_points;
+int format = FORMAT_TEXT;
+int layout = LAYOUT_ID;
 long current_id = 0;
 
-typedef struct _node
-{
-    long id;
-    double *center;
-    double radius;
-    struct _node *L;
-    struct _node *R;
-} node_t;
+/* Nodes are laid out implicitly by preorder id: a node over m points has its
+ * left child, over m / 2 of them, at id + 1 and its right child after the
+ * left subtree, and is a leaf when m is at most leaf_size (see tree_io.h).
+ * Only the radii and centers are stored, both indexed by id */
+long leaf_size = 1;
+long n_nodes;
+double *radii;
+double *centers;
 
 #pragma region math
 
-double quick_distance(double *pt1, double *pt2)
+/* Points are stored dimension-major: coordinate d of the point at position i
+ * is pts[d * n_points + i]. Every node owns a contiguous range of positions,
+ * so the sweeps below are unit-stride */
+double *pts;
+long *ids;          /* original index of the point at each position */
+long *perm;         /* positions in selection order */
+double *keys;       /* projection of the point at perm[i] onto ab, as a scalar;
+                       also the output of the distance sweeps */
+double *scratch;    /* gather buffers for apply_permutation */
+long *id_scratch;
+
+/* Low-memory mode swaps the points themselves during selection, so perm and
+ * the gather buffers aren't allocated; a little slower */
+int low_memory = 0;
+
+/* Copies the point at position i of a dimension-major array into p */
+void get_point(double *soa, long i, double *p)
 {
-    double dist = 0.0;
-
     for (int d = 0; d < n_dims; d++)
-        dist += (pt1[d] - pt2[d]) * (pt1[d] - pt2[d]);
-    return dist;
+    {
+        p[d] = soa[d * n_points + i];
+    }
 }
 
-double distance(double *pt1, double *pt2)
+/* Squared distance from p to every point in l..r, saved in out[l..r] */
+void sweep_distances(double *p, long l, long r, double *out)
 {
-    double dist = 0.0;
-
-    for (int d = 0; d < n_dims; d++)
-        dist += (pt1[d] - pt2[d]) * (pt1[d] - pt2[d]);
-    return sqrt(dist);
+    distance_kernel(pts, n_points, n_dims, p, l, r, out);
 }
 
 void mean(double *pt1, double *pt2, double *mean)
@@ -47,38 +64,77 @@ void mean(double *pt1, double *pt2, double *mean)
     }
 }
 
-void get_furthest_points(double **pts, long l, long r, double **a, double **b)
+/* Distance from p to the furthest point in l..r, the radius of a ball
+ * around p; sqrt is monotonic so only the largest square is taken */
+double furthest_distance(double *p, long l, long r)
+{
+    double max_distance = 0.0;
+
+    sweep_distances(p, l, r, keys);
+    for (long i = l; i < r + 1; i++)
+    {
+        if (keys[i] > max_distance)
+        {
+            max_distance = keys[i];
+        }
+    }
+    return sqrt(max_distance);
+}
+
+/* Mean of the points in l..r, the center of a bucket leaf */
+void centroid(long l, long r, double *center)
 {
+    for (int d = 0; d < n_dims; d++)
+    {
+        double *x = &pts[d * n_points];
+        double sum = 0.0;
+
+        for (long i = l; i < r + 1; i++)
+        {
+            sum += x[i];
+        }
+        center[d] = sum / (r - l + 1);
+    }
+}
 
+/* Positions of the furthest points a and b in l..r */
+void get_furthest_points(long l, long r, long *a, long *b)
+{
     long i;
-    double dist, max_distance = 0.0;
+    double max_distance = 0.0;
+    double p[n_dims];
 
     /* finds first point relative to the original set */
-    *b = pts[l];
+    *b = l;
     for (i = l + 1; i < r + 1; i++)
     {
-        *b = pts[i] < *b ? pts[i] : *b;
+        *b = ids[i] < ids[*b] ? i : *b;
     }
 
     /* Lock b as first point in set and find a */
+    get_point(pts, *b, p);
+    sweep_distances(p, l, r, keys);
+    *a = *b;
     for (i = l; i < r + 1; i++)
     {
-        if ((dist = quick_distance(*b, pts[i])) > max_distance)
+        if (keys[i] > max_distance)
         {
-            *a = pts[i];
-            max_distance = dist;
+            *a = i;
+            max_distance = keys[i];
         }
     }
 
     max_distance = 0.0;
 
     /* Find b */
+    get_point(pts, *a, p);
+    sweep_distances(p, l, r, keys);
     for (i = l; i < r + 1; i++)
     {
-        if ((dist = quick_distance(*a, pts[i])) > max_distance)
+        if (keys[i] > max_distance)
         {
-            *b = pts[i];
-            max_distance = dist;
+            *b = i;
+            max_distance = keys[i];
         }
     }
 }
@@ -130,140 +186,130 @@ void mul_point(double *p1, double constant, double *result)
     }
 }
 
-/* Projects p onto ab */
-void project(double *p, double *a, double *b_a, double *common_factor, double *result)
+/* Projects every point in l..r onto ab, as keys[i] * key_factor relative to a */
+void project(long l, long r, double *a, double *key_factor)
 {
-    double product;
-
-    sub_points(p, a, result);
-    product = inner_product(result, common_factor);
-
-    mul_point(b_a, product, result);
+    project_kernel(pts, n_points, n_dims, a, key_factor, l, r, keys);
 }
 
-#pragma endregion
-
-#pragma region qselect
-
-#define SWAP(x, y)         \
-    {                      \
-        double *temp1 = x; \
-        x = y;             \
-        y = temp1;         \
-    }
-
-int less_than(double *p1, double *p2)
+/* The projections are b_a * t, so their lexicographic order is the order of
+ * t times the sign of b_a's first nonzero coordinate; keys hold that product */
+double key_sign(double *b_a)
 {
-    for (long i = 0; i < n_dims; i++)
+    for (int d = 0; d < n_dims; d++)
     {
-        if (p1[i] < p2[i])
+        if (b_a[d] > 0)
         {
-            return 1;
+            return 1.0;
         }
-        else if (p1[i] > p2[i])
+        else if (b_a[d] < 0)
         {
-            return 0;
+            return -1.0;
         }
     }
-    return 0;
+    return 1.0;
 }
 
-long median_of_three(double **pts, double **projs, long l, long r)
+/* Moves the points in l..r into the order left in perm by the selection */
+void apply_permutation(long l, long r)
 {
-    long m = (l + r) / 2;
-    if (less_than(projs[r], projs[l]))
-    {
-        SWAP(projs[r], projs[l]);
-        SWAP(pts[r], pts[l]);
-    }
-    if (less_than(projs[m], projs[l]))
+    long i;
+
+    for (int d = 0; d < n_dims; d++)
     {
-        SWAP(projs[m], projs[l]);
-        SWAP(pts[m], pts[l]);
+        double *x = &pts[d * n_points];
+
+        for (i = l; i < r + 1; i++)
+        {
+            scratch[i] = x[perm[i]];
+        }
+        memcpy(&x[l], &scratch[l], (r - l + 1) * sizeof(double));
     }
-    if (less_than(projs[r], projs[m]))
+
+    for (i = l; i < r + 1; i++)
     {
-        SWAP(projs[r], projs[m]);
-        SWAP(pts[r], pts[m]);
+        id_scratch[i] = ids[perm[i]];
     }
-    return m;
+    memcpy(&ids[l], &id_scratch[l], (r - l + 1) * sizeof(long));
 }
 
-long partition(double **pts, double **projs, long l, long r, long pivotIndex)
+/* Exchanges the points at positions i and j, all coordinates and the index */
+void swap_points(long i, long j)
 {
+    long temp_id = ids[i];
 
-    double *pivotValue = projs[pivotIndex];
-
-    SWAP(projs[pivotIndex], projs[r]);
-    SWAP(pts[pivotIndex], pts[r]);
-    long storeIndex = l;
-
-    for (long i = l; i < r; i++)
+    ids[i] = ids[j];
+    ids[j] = temp_id;
+    for (int d = 0; d < n_dims; d++)
     {
-        if (less_than(projs[i], pivotValue))
-        {
-            SWAP(projs[storeIndex], projs[i]);
-            SWAP(pts[storeIndex], pts[i]);
-            storeIndex++;
-        }
+        double *x = &pts[d * n_points];
+        double temp_x = x[i];
+
+        x[i] = x[j];
+        x[j] = temp_x;
     }
+}
 
-    SWAP(projs[r], projs[storeIndex]);
-    SWAP(pts[r], pts[storeIndex]);
+#pragma endregion
 
-    return storeIndex;
-}
+#pragma region qselect
 
-double *qselect(double **pts, double **projs, long l, long r, long k)
-{
-    /* This way of doing it uses less stack */
-    while (1)
-    {
-        if (l == r)
-        {
-            return projs[l];
-        }
-        long pivotIndex = median_of_three(pts, projs, l, r);
-        pivotIndex = partition(pts, projs, l, r, pivotIndex);
-        if (k == pivotIndex)
-        {
-            return projs[k];
-        }
-        else if (k < pivotIndex)
-        {
-            r = pivotIndex - 1;
-        }
-        else
-        {
-            l = pivotIndex + 1;
-        }
+/* Selection permutes the keys and their positions in perm together, the
+ * points stay in place; in low-memory mode the points move with the keys */
+#define SWAP(i, j)                   \
+    {                                \
+        double temp_key = keys[i];   \
+        keys[i] = keys[j];           \
+        keys[j] = temp_key;          \
+        if (low_memory)              \
+        {                            \
+            swap_points(i, j);       \
+        }                            \
+        else                         \
+        {                            \
+            long temp_pos = perm[i]; \
+            perm[i] = perm[j];       \
+            perm[j] = temp_pos;      \
+        }                            \
     }
-}
 
-/* Computes the median point of a set of points in a line */
-long median(double **pts, double **projs, long l, long r, double *center_pt)
+#define SELECT_KEY(i) keys[i]
+#define SELECT_SWAP(i, j) SWAP(i, j)
+#include "qselect.h"
+
+/* Computes the median point of a set of points in a line; only the
+ * projection of the median itself becomes a vector, b_a * key * sign */
+long median(long l, long r, double *b_a, double sign, double *center_pt)
 {
     long projs_size = (r - l + 1);
     long k = projs_size / 2;
 
+    for (long i = l; !low_memory && i < r + 1; i++)
+    {
+        perm[i] = i;
+    }
+
     if (projs_size % 2 != 0)
     {
-        memcpy(center_pt, qselect(pts, projs, l, r, k + l), sizeof(double) * n_dims);
+        mul_point(b_a, select_kth(l, r, k + l) * sign, center_pt);
     }
     else
     {
-        qselect(pts, projs, l, r, k + l);
+        double kth = select_kth(l, r, k + l);
 
         /* Finds point immediately before kth point */
-        double *current = projs[l];
+        double current = keys[l];
         for (long i = l + 1; i < k + l; i++)
         {
-            if (less_than(current, projs[i]))
+            if (current < keys[i])
             {
-                current = projs[i];
+                current = keys[i];
             }
         }
-        mean(current, projs[k + l], center_pt);
+        double before[n_dims], after[n_dims];
+        mul_point(b_a, current * sign, before);
+        mul_point(b_a, kth * sign, after);
+        mean(before, after, center_pt);
     }
     k--;
     return k;
@@ -271,98 +317,133 @@ long median(double **pts, double **projs, long l, long r, double *center_pt)
 
 #pragma endregion
 
-node_t *build_tree(double **pts, double **projections, node_t *nodes, long l, long r)
+#pragma region print
+
+/* Center of node id */
+double *node_center(long id)
+{
+    return &centers[id * n_dims];
+}
+
+/* Text output is streamed by build_tree: the text lists every node after
+ * its subtrees, which is the order they are finished in */
+tree_writer_t *writer;
+
+void print_node(long id, long size)
 {
-    node_t *node = &nodes[current_id];
+    if (writer)
+    {
+        writer_node(writer, id, left_child(id, size, leaf_size), right_child(id, size, leaf_size),
+                    radii[id], node_center(id));
+    }
+}
+
+/* Position i of the sorted points, for the binary writers */
+void sorted_point(long i, double *p)
+{
+    get_point(pts, i, p);
+}
 
-    node->id = current_id++;
-    node->radius = 0.0;
+#pragma endregion print
+
+void build_tree(long l, long r)
+{
+    long id = current_id++;
+    double *center = node_center(id);
+
+    radii[id] = 0.0;
 
     /* It's a leaf */
     if (r - l == 0)
     {
-        node->center = pts[l];
-        node->L = NULL;
-        node->R = NULL;
-        return node;
+        get_point(pts, l, center);
+        print_node(id, 1);
+        return;
+    }
+
+    /* A bucket leaf keeps its points, inside a ball around their mean */
+    if (r - l + 1 <= leaf_size)
+    {
+        centroid(l, r, center);
+        radii[id] = furthest_distance(center, l, r);
+        print_node(id, r - l + 1);
+        return;
     }
 
-    double *a, *b;
+    long a_pos, b_pos;
 
-    get_furthest_points(pts, l, r, &a, &b);
+    get_furthest_points(l, r, &a_pos, &b_pos);
+
+    double a[n_dims], b[n_dims];
+    get_point(pts, a_pos, a);
+    get_point(pts, b_pos, b);
 
     /* Compute common factors to all projections */
     double b_a[n_dims];
     sub_points(b, a, b_a);
     double denominator = inner_product(b_a, b_a);
     double common_factor[n_dims];
-    mul_point(b_a, 1 / denominator, common_factor);
+    /* All points coincide if a = b, then they all project onto a */
+    mul_point(b_a, denominator > 0 ? 1 / denominator : 0, common_factor);
 
-    /* Project points onto ab */
-    for (long i = l; i < r + 1; i++)
-    {
-        project(pts[i], a, b_a, common_factor, projections[i]);
-    }
+    /* Project points onto ab, keeping one scalar key per point */
+    double sign = key_sign(b_a);
+    double key_factor[n_dims];
+    mul_point(common_factor, sign, key_factor);
+    project(l, r, a, key_factor);
 
     /* Find median point and split; 2 in 1 GIGA FAST */
-    long split_index = median(pts, projections, l, r, node->center);
+    long split_index = median(l, r, b_a, sign, center);
 
     /* Since the projection skips summing a at the end it must be done here */
-    add_points(node->center, a, node->center);
-
-    /* Compute radius */
-    for (long i = l; i < r + 1; i++)
-    {
-        double dist = distance(node->center, pts[i]);
-        if (dist > node->radius)
-        {
-            node->radius = dist;
-        }
-    }
+    add_points(center, a, center);
 
-    node->L = build_tree(pts, projections, nodes, l, l + split_index);
-    node->R = build_tree(pts, projections, nodes, l + split_index + 1, r);
+    radii[id] = furthest_distance(center, l, r);
 
-    return node;
-}
-
-#pragma region print
-
-void print_node(node_t *node)
-{
-    if (node->L)
-        print_node(node->L);
-    if (node->R)
-        print_node(node->R);
-
-    printf("%ld %ld %ld %lf",
-           node->id,
-           node->L ? node->L->id : -1,
-           node->R ? node->R->id : -1,
-           node->radius);
-
-    for (long i = 0; i < n_dims; i++)
+    /* Each child's points become contiguous, as leaves end up in memory order */
+    if (!low_memory)
     {
-        printf(" %lf", node->center[i]);
+        apply_permutation(l, r);
     }
-    printf(" \n");
-}
 
-void dump_tree(node_t *root)
-{
-    printf("%d %ld\n", n_dims, current_id);
-    print_node(root);
+    build_tree(l, l + split_index);
+    build_tree(l + split_index + 1, r);
+    print_node(id, r - l + 1);
 }
 
-#pragma endregion
 
 int main(int argc, char *argv[])
 {
     double exec_time;
     unsigned seed;
 
-    if(argc != 4){
-        printf("Usage: %s <n_dims> <n_points> <seed>\n", argv[0]);
+    if(argc < 4){
+        printf("Usage: %s <n_dims> <n_points> <seed> [--format=text|bin] [--layout=id|veb] [--points=uniform|clustered|duplicates] [--leaf-size=B] [--low-memory]\n", argv[0]);
+        exit(1);
+    }
+    for(int i = 4; i < argc; i++){
+        long value;
+
+        if(strcmp(argv[i], "--low-memory") == 0)
+            low_memory = 1;
+        else if((value = parse_leaf_size(argv[i])) >= 0)
+            leaf_size = value;
+        else if((value = parse_layout(argv[i])) >= 0)
+            layout = value;
+        else if((value = parse_format(argv[i])) >= 0)
+            format = value;
+        else if(parse_distribution(argv[i]) < 0){
+            printf("Usage: %s <n_dims> <n_points> <seed> [--format=text|bin] [--layout=id|veb] [--points=uniform|clustered|duplicates] [--leaf-size=B] [--low-memory]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if(leaf_size < 1){
+        printf("Illegal leaf size, must be above 0.\n");
+        exit(1);
+    }
+    if(leaf_size > 1 && format == FORMAT_TEXT){
+        printf("Bucket leaves (--leaf-size above 1) need --format=bin.\n");
         exit(1);
     }
 
@@ -382,42 +463,61 @@ int main(int argc, char *argv[])
     srandom(seed);
 
     exec_time = -omp_get_wtime();
-    double **pts = get_points(argc, argv, &n_dims, &n_points, 0, 0);
-    double *to_free = *pts;
-
-    /* Allocate memory for projections */
-    double **projections = (double **)malloc(n_points * sizeof(double *));
-    assert(projections);
-    double *proj = (double *)malloc(n_points * n_dims * sizeof(double));
-    assert(proj);
+    pts = get_points_soa(argc, argv, &n_dims, &n_points);
+    init_kernels(n_dims);
+
+    /* Allocate memory for the keys and the position permutations */
+    keys = (double *)malloc(n_points * sizeof(double));
+    assert(keys);
+    ids = (long *)malloc(n_points * sizeof(long));
+    assert(ids);
+    if (!low_memory)
+    {
+        perm = (long *)malloc(n_points * sizeof(long));
+        assert(perm);
+        scratch = (double *)malloc(n_points * sizeof(double));
+        assert(scratch);
+        id_scratch = (long *)malloc(n_points * sizeof(long));
+        assert(id_scratch);
+    }
 
     for (long i = 0; i < n_points; i++)
     {
-        projections[i] = &proj[i * n_dims];
+        ids[i] = i;
     }
 
     /* Allocate memory for nodes */
-    node_t *nodes = (node_t *)malloc((2 * n_points - 1) * sizeof(node_t));
-    assert(nodes);
-    double *centers = (double *)malloc((2 * n_points - 1) * n_dims * sizeof(node_t));
+    n_nodes = tree_nodes(n_points, leaf_size);
+    radii = (double *)malloc(n_nodes * sizeof(double));
+    assert(radii);
+    centers = (double *)malloc(n_nodes * n_dims * sizeof(double));
     assert(centers);
 
-    for (long i = 0; i < 2 * n_points - 1; i++)
+    if (format == FORMAT_TEXT)
     {
-        nodes[i].center = &centers[i * n_dims];
+        writer = writer_open(stdout, n_dims);
+        assert(writer);
+        writer_header(writer, n_dims, n_nodes);
     }
 
-    node_t *root = build_tree(pts, projections, nodes, 0, n_points - 1);
+    build_tree(0, n_points - 1);
 
     exec_time += omp_get_wtime();
     fprintf(stderr, "%.1f\n", exec_time);
 
-    dump_tree(root);
+    if (format == FORMAT_TEXT)
+        writer_close(writer);
+    else if (layout == LAYOUT_VEB)
+        dump_tree_veb(stdout, n_dims, n_points, leaf_size, radii, centers, sorted_point);
+    else
+        dump_tree_bin(stdout, n_dims, n_points, leaf_size, radii, centers, sorted_point);
 
-    free(nodes);
+    free(radii);
     free(centers);
-    free(projections);
-    free(proj);
-    free(to_free);
+    free(keys);
+    free(scratch);
+    free(ids);
+    free(perm);
+    free(id_scratch);
     free(pts);
 }
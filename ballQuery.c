@@ -1,130 +1,855 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tree_io.h"
 
-typedef struct _node {
-    double radius;
-    long id;
-    long L;
-    long R;
-} node_t;
+#define BATCH_SIZE 65536
+#define BUCKET_BLOCK 64   // bucket points scored per vector sweep
 
-typedef struct _hash {
-    long id;
-    long index;
-    struct _hash *next;
-} hash_t;
+typedef struct _neighbour {
+    double dist;
+    long idx;
+} neighbour_t;
+
+typedef struct _pending {
+    double lower;   // lower bound on the distance to any sample in the node
+    double dist;    // distance to the node's center
+    long idx;
+} pending_t;
+
+typedef struct _query {
+    double *point;
+    long n_found;
+    neighbour_t *best;   // max-heap of the k closest leaves, farthest on top
+    pending_t *frontier; // min-heap of nodes still to visit, best-first only
+    long n_pending;
+    long frontier_size;
+    long leaf_evals;     // this query's, checked against max_visits
+    double skipped;      // smallest lower bound left unexplored by eps or max_visits
+    double error;        // this query's achieved error bound
+    long visited;        // statistics, over all queries
+    long dist_evals;
+} query_t;
 
 int n_dims;
 long n_nodes;
-double *point;
+long k = 1;
+double range = -1.0;   // range query radius, unused if negative
+int depth_first = 0;
+int stats = 0;
+int triangle = 0;
+double eps = 0.0;      // approximate search: prune at (k-th best) / (1 + eps)
+long max_visits = 0;   // approximate search: leaf evaluations per query, 0 for no limit
+long total_queries, total_visited, total_dist_evals;
+double worst_error, total_error;
+
+tree_record_t *tree;
+double *centers;
+double *gaps;   // distance from each center to its parent's, only with --triangle
+double *points; // samples of the bucket leaves, NULL if every leaf is a sample
+long n_points;
+
+
+void allocate_tree()
+{
+    tree = (tree_record_t *) malloc(n_nodes * sizeof(tree_record_t));
+    centers = (double *) malloc(n_nodes * n_dims * sizeof(double));
+    if((centers == NULL) || (tree == NULL)){
+        printf("Error allocating tree, exiting.\n");
+        exit(10);
+    }
+}
+
+
+/* Specialized below for the common n_dims, where the loop unrolls into
+ * registers; n_dims is fixed once the tree is loaded, so the switch always
+ * takes the same branch */
+static inline __attribute__((always_inline)) double sum_squares(double *pt1, double *pt2, int dims)
+{
+    double dist = 0.0;
 
-node_t *tree;
-double **center;
-hash_t **hash;
+    for(int d = 0; d < dims; d++)
+        dist += (pt1[d] - pt2[d]) * (pt1[d] - pt2[d]);
+    return dist;
+}
+
+static inline double quick_distance(double *pt1, double *pt2)
+{
+    switch(n_dims){
+        case 2:
+            return sum_squares(pt1, pt2, 2);
+        case 3:
+            return sum_squares(pt1, pt2, 3);
+        case 4:
+            return sum_squares(pt1, pt2, 4);
+        case 20:
+            return sum_squares(pt1, pt2, 20);
+        default:
+            return sum_squares(pt1, pt2, n_dims);
+    }
+}
 
-long currBest;
-double minDist = 1000000.0;
+double distance(double *pt1, double *pt2)
+{
+    return sqrt(quick_distance(pt1, pt2));
+}
 
+/* Squared distances from p to the n points at pts, a point per row; each
+ * lane of the vector loop is one point, summed in the same order as
+ * quick_distance */
+static inline __attribute__((always_inline)) void block_squares(double *pts, long n, double *p, double *out, int dims)
+{
+#pragma omp simd
+    for(long i = 0; i < n; i++)
+        out[i] = sum_squares(&pts[i * dims], p, dims);
+}
 
-void allocate_hash()
+static void block_distances(double *pts, long n, double *p, double *out)
 {
-    hash = (hash_t **) calloc(n_nodes, sizeof(hash_t *));
-    if(hash == NULL){
-        printf("Error allocating hash, exiting.\n");
-        exit(20);
+    switch(n_dims){
+        case 2:
+            block_squares(pts, n, p, out, 2);
+            break;
+        case 3:
+            block_squares(pts, n, p, out, 3);
+            break;
+        case 4:
+            block_squares(pts, n, p, out, 4);
+            break;
+        case 20:
+            block_squares(pts, n, p, out, 20);
+            break;
+        default:
+            block_squares(pts, n, p, out, n_dims);
     }
 }
 
-void hash_insert(long tree_id, long array_idx)
+
+void init_query(query_t *q)
 {
-    hash_t *new;
-    long i;
+    q->best = (neighbour_t *) malloc(k * sizeof(neighbour_t));
+    q->frontier_size = 64;
+    q->frontier = (pending_t *) malloc(q->frontier_size * sizeof(pending_t));
+    q->visited = 0;
+    q->dist_evals = 0;
+    if(q->best == NULL || q->frontier == NULL){
+        printf("Error allocating neighbours, exiting.\n");
+        exit(4);
+    }
+}
 
-    i = tree_id % n_nodes;
+// distance to beat, that of the k-th closest leaf so far
+double kth_dist(query_t *q)
+{
+    return q->n_found < k ? INFINITY : q->best[0].dist;
+}
+
+// distance a node's lower bound must beat to be entered
+double prune_dist(query_t *q)
+{
+    return kth_dist(q) / (1.0 + eps);
+}
+
+int out_of_budget(query_t *q)
+{
+    return max_visits > 0 && q->leaf_evals >= max_visits;
+}
+
+/* Records a node left out that may hold a sample closer than the k-th best
+ * found, the achieved error bound is derived from the smallest of these */
+void skip(query_t *q, double lower)
+{
+    q->skipped = fmin(q->skipped, fmax(lower, 0.0));
+}
+
+/* The true k-th distance is at least min(skipped, k-th found), so the k-th
+ * found is within this factor of it */
+double achieved_error(query_t *q)
+{
+    double found = kth_dist(q);
+
+    return q->skipped >= found ? 1.0 : found / q->skipped;
+}
+
+/* Puts nb at i and moves it down the first n heap entries */
+void sift_down(neighbour_t *heap, long n, long i, neighbour_t nb)
+{
+    long c;
 
-    new = (hash_t *) malloc(sizeof(hash_t));
-    new->id = tree_id;
-    new->index = array_idx;
-    new->next = hash[i];
-    hash[i] = new;
+    while((c = 2 * i + 1) < n){
+        if(c + 1 < n && heap[c + 1].dist > heap[c].dist)
+            c++;
+        if(heap[c].dist <= nb.dist)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = nb;
 }
 
-long hash_get_index(long id)
+void offer(query_t *q, double dist, long idx)
 {
+    neighbour_t nb = {dist, idx};
     long i;
-    hash_t *h;
 
-    i = id % n_nodes;
+    if(q->n_found < k){
+        for(i = q->n_found++; i > 0 && q->best[(i - 1) / 2].dist < dist; i = (i - 1) / 2)
+            q->best[i] = q->best[(i - 1) / 2];
+        q->best[i] = nb;
+    }
+    else if(dist < q->best[0].dist)
+        sift_down(q->best, k, 0, nb);
+}
+
+int is_leaf(long idx)
+{
+    return tree[idx].left < 0;
+}
+
+/* Leaves are the samples themselves, unless the tree has bucket leaves;
+ * answers are then indices into points instead of nodes */
+double *sample(long idx)
+{
+    return points ? &points[idx * n_dims] : &centers[idx * n_dims];
+}
+
+/* First point of the bucket leaf idx, and how many it has in count; buckets
+ * are checked as they are reached, so loading stays independent of size */
+long bucket(long idx, long *count)
+{
+    long first = bucket_first(&tree[idx]);
+
+    *count = tree[idx].right;
+    if(first < 0 || *count < 1 || *count > n_points - first){
+        printf("Bucket of node %ld out of range.\n", idx);
+        exit(30);
+    }
+    return first;
+}
+
+/* Scores every point in a bucket leaf, a block at a time */
+void scan_bucket(query_t *q, long idx)
+{
+    double dist2[BUCKET_BLOCK];
+    long count, first = bucket(idx, &count);
+    long n, i;
+
+    for(; count > 0; first += n, count -= n){
+        n = count < BUCKET_BLOCK ? count : BUCKET_BLOCK;
+        block_distances(&points[first * n_dims], n, q->point, dist2);
+        q->dist_evals += n;
+        q->leaf_evals += n;
+        for(i = 0; i < n; i++){
+            if(dist2[i] < kth_dist(q) * kth_dist(q))
+                offer(q, sqrt(dist2[i]), first + i);
+        }
+    }
+}
+
+/* Lower bound on the distance to any sample in idx that needs no distance
+ * evaluation: the triangle inequality through the parent's center */
+double triangle_bound(long idx, double parent_dist)
+{
+    return gaps ? fabs(parent_dist - gaps[idx]) - tree[idx].radius : 0.0;
+}
 
-    for(h = hash[i]; h != NULL && h->id != id; h = h->next);
+void search_child(query_t *q, long idx, double parent_dist);
 
-    if(h == NULL){
-	printf("Id %ld not found?!\n", id);
-	exit(30);
+// dist is the distance from the query to idx's center
+void search_tree(query_t *q, long idx, double dist)
+{
+    q->visited++;
+    if(is_leaf(idx)){
+        if(points)
+            scan_bucket(q, idx);
+        else if(dist < kth_dist(q))
+            offer(q, dist, idx);
+        return;
     }
 
-    return h->index;
+    search_child(q, tree[idx].left, dist);
+    search_child(q, tree[idx].right, dist);
 }
-    
-void allocate_tree()
+
+/* Enters idx only if its own ball may hold a sample closer than the k-th
+ * best; a child's ball is not contained in its parent's */
+void search_child(query_t *q, long idx, double parent_dist)
 {
-    double *_p_center;
+    double bound, lower, dist;
 
-    tree = (node_t *) malloc(n_nodes * sizeof(node_t));
-    _p_center = (double *) malloc(n_nodes * n_dims * sizeof(double));
-    center = (double **) malloc(n_nodes * sizeof(double *));
-    if((_p_center == NULL) || (center == NULL) || (tree == NULL)){
-        printf("Error allocating tree, exiting.\n");
-        exit(10);
+    // leaves are scored exactly, eps only prunes balls
+    bound = is_leaf(idx) ? kth_dist(q) : prune_dist(q);
+    if((lower = triangle_bound(idx, parent_dist)) >= bound){
+        skip(q, lower);
+        return;
     }
-    for(long i = 0; i < n_nodes; i++)
-        center[i] = &(_p_center[i * n_dims]);
+
+    q->dist_evals++;
+    dist = distance(&centers[idx * n_dims], q->point);
+    if((lower = dist - tree[idx].radius) < bound)
+        search_tree(q, idx, dist);
+    else
+        skip(q, lower);
 }
 
+void push_pending(query_t *q, double lower, double dist, long idx)
+{
+    pending_t *heap;
+    long i;
 
-double distance(double *pt1, double *pt2)
+    if(q->n_pending == q->frontier_size){
+        q->frontier_size *= 2;
+        q->frontier = (pending_t *) realloc(q->frontier, q->frontier_size * sizeof(pending_t));
+        if(q->frontier == NULL){
+            printf("Error allocating frontier, exiting.\n");
+            exit(4);
+        }
+    }
+
+    heap = q->frontier;
+    for(i = q->n_pending++; i > 0 && heap[(i - 1) / 2].lower > lower; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i].lower = lower;
+    heap[i].dist = dist;
+    heap[i].idx = idx;
+}
+
+pending_t pop_pending(query_t *q)
 {
-    double dist = 0.0;
+    pending_t *heap = q->frontier;
+    pending_t top = heap[0], last = heap[--q->n_pending];
+    long i = 0, c, n = q->n_pending;
+
+    while((c = 2 * i + 1) < n){
+        if(c + 1 < n && heap[c + 1].lower < heap[c].lower)
+            c++;
+        if(heap[c].lower >= last.lower)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* Checks a child of an expanded node: leaves are scored right away, other
+ * nodes wait in the frontier ordered by their lower bound. Distances stay
+ * squared unless the node survives */
+void visit_child(query_t *q, long idx, double parent_dist)
+{
+    double bound, lower, dist2, dist;
+    double radius = tree[idx].radius;
+
+    // leaves are scored exactly, eps only prunes balls
+    bound = is_leaf(idx) ? kth_dist(q) : prune_dist(q);
+    if((lower = triangle_bound(idx, parent_dist)) >= bound){
+        skip(q, lower);
+        return;
+    }
+
+    q->dist_evals++;
+    dist2 = quick_distance(&centers[idx * n_dims], q->point);
+    // past the budget a leaf is only measured, balls still go to the frontier
+    if(is_leaf(idx) && out_of_budget(q)){
+        skip(q, sqrt(dist2) - radius);
+        return;
+    }
+    if(is_leaf(idx) && !points){
+        q->leaf_evals++;
+        if(dist2 < bound * bound){
+            q->visited++;
+            offer(q, sqrt(dist2), idx);
+        }
+    }
+    else if(dist2 < (bound + radius) * (bound + radius)){
+        dist = sqrt(dist2);
+        // a bucket is scanned right away, as a single leaf would be scored
+        if(is_leaf(idx)){
+            q->visited++;
+            scan_bucket(q, idx);
+        }
+        else
+            push_pending(q, fmax(dist - radius, 0.0), dist, idx);
+    }
+    else if(eps > 0.0)   // exact pruning never loosens the bound
+        skip(q, sqrt(dist2) - radius);
+}
+
+/* Visits nodes closest first; stops once no pending ball can hold a sample
+ * closer than the k-th best found (over 1 + eps), or the budget runs out */
+void search_best_first(query_t *q)
+{
+    pending_t node;
+
+    q->n_pending = 0;
+    q->dist_evals++;
+    push_pending(q, 0.0, distance(&centers[0], q->point), 0);
+    while(q->n_pending > 0){
+        node = pop_pending(q);
+        // the rest of the frontier is no closer than node
+        if(node.lower >= prune_dist(q) || out_of_budget(q)){
+            skip(q, node.lower);
+            break;
+        }
+        q->visited++;
+        if(is_leaf(node.idx)){   // tree is a single leave
+            if(points)
+                scan_bucket(q, node.idx);
+            else{
+                q->leaf_evals++;
+                offer(q, node.dist, node.idx);
+            }
+            continue;
+        }
+        visit_child(q, tree[node.idx].left, node.dist);
+        visit_child(q, tree[node.idx].right, node.dist);
+    }
+}
+
+// index 0 is root; q->best has the results, closest first
+void nearest(query_t *q, double *point)
+{
+    neighbour_t last;
+
+    q->point = point;
+    q->n_found = 0;
+    q->leaf_evals = 0;
+    q->skipped = INFINITY;
+    if(depth_first){
+        q->dist_evals++;
+        search_tree(q, 0, distance(&centers[0], point));
+    }
+    else
+        search_best_first(q);
+    q->error = achieved_error(q);
+
+    // heap sort, the farthest goes to the end
+    for(long n = q->n_found - 1; n > 0; n--){
+        last = q->best[n];
+        q->best[n] = q->best[0];
+        sift_down(q->best, n, 0, last);
+    }
+}
 
+void print_sample(FILE *out, long idx)
+{
     for(int d = 0; d < n_dims; d++)
-        dist += (pt1[d] - pt2[d]) * (pt1[d] - pt2[d]);
-    return sqrt(dist);
+        fprintf(out, "%lf ", sample(idx)[d]);
+    fprintf(out, "\n");
 }
 
+void print_subtree(FILE *out, long idx)
+{
+    long count, first;
+
+    if(is_leaf(idx) && points){
+        first = bucket(idx, &count);
+        for(long i = 0; i < count; i++)
+            print_sample(out, first + i);
+        return;
+    }
+    if(is_leaf(idx)){
+        print_sample(out, idx);
+        return;
+    }
+    print_subtree(out, tree[idx].left);
+    print_subtree(out, tree[idx].right);
+}
 
-void search_tree(long idx)
+/* Prints every sample within range of point as soon as it is found */
+void search_range(FILE *out, double *point, long idx)
 {
-    double dist;
-    long idxl, idxr;
+    double dist = distance(&centers[idx * n_dims], point);
+    long count, first;
 
-    if(tree[idx].radius == 0.0){   // found leave
-        dist = distance(center[idx], point);
-        if(dist < minDist){
-            minDist = dist;
-            currBest = idx;
+    if(dist - tree[idx].radius > range)    // ball is outside the sphere
+        return;
+    if(dist + tree[idx].radius <= range){  // ball is inside, take it all
+        print_subtree(out, idx);
+        return;
+    }
+    if(is_leaf(idx)){                      // a bucket across the sphere
+        first = bucket(idx, &count);
+        for(long i = first; i < first + count; i++){
+            if(distance(sample(i), point) <= range)
+                print_sample(out, i);
         }
         return;
     }
-    
-    idxl = hash_get_index(tree[idx].L);
-    if(distance(center[idxl], point) - tree[idx].radius < minDist)
-        search_tree(idxl);
-    idxr = hash_get_index(tree[idx].R);
-    if(distance(center[idxr], point) - tree[idx].radius < minDist)
-        search_tree(idxr);
+
+    search_range(out, point, tree[idx].left);
+    search_range(out, point, tree[idx].right);
 }
 
-int main(int argc, char *argv[])
+void check_id(long id)
 {
-    FILE *fp;
-    node_t *node;
+    if(id < 0 || id >= n_nodes){
+        printf("Node id %ld out of range.\n", id);
+        exit(30);
+    }
+}
+
+// nodes are stored at their id, so ids are also indexes
+void load_tree_text(FILE *fp)
+{
+    tree_record_t *node;
     long i,
-	 node_idx;
+	 node_id;
     int d;
 
-    if(argc < 3){
-        printf("Usage: %s <ball-tree-file> <point>\n", argv[0]);
+    allocate_tree();
+    for(i = 0; i < n_nodes; i++){
+        fscanf(fp, "%ld", &node_id);
+        check_id(node_id);
+        node = &(tree[node_id]);
+        node->id = node_id;
+        fscanf(fp, "%ld %ld %lf", &(node->left), &(node->right), &(node->radius));
+        for(d = 0; d < n_dims; d++)
+            fscanf(fp, "%lf", &(centers[node_id * n_dims + d]));
+    }
+}
+
+/* Maps the file so records, centers and bucket points are searched in place,
+ * no parsing or copying; returns the mapped size, 0 if fp can't be mapped
+ * (e.g. a pipe) */
+size_t map_tree_bin(FILE *fp, unsigned flags)
+{
+    struct stat st;
+    char *base;
+    size_t size = sizeof(tree_header_t) + n_nodes * (sizeof(tree_record_t) + n_dims * sizeof(double));
+
+    if(fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    if(flags & TREE_BUCKETS)
+        size += sizeof(int64_t);
+    if((size_t) st.st_size < size){
+        printf("Tree file is truncated.\n");
+        exit(5);
+    }
+
+    // the points section is sized by its count, so the whole file is mapped
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if(base == MAP_FAILED)
+        return 0;
+
+    tree = (tree_record_t *) (base + sizeof(tree_header_t));
+    centers = (double *) (tree + n_nodes);
+    if(flags & TREE_BUCKETS){
+        n_points = *(int64_t *) (centers + n_nodes * n_dims);
+        points = (double *) (centers + n_nodes * n_dims + 1);
+        if(n_points < 1 || (size_t) st.st_size < size + n_points * n_dims * sizeof(double)){
+            printf("Tree file is truncated.\n");
+            exit(5);
+        }
+    }
+    return st.st_size;
+}
+
+void read_tree_bin(FILE *fp, unsigned flags)
+{
+    int64_t count;
+
+    allocate_tree();
+    if(fread(tree, sizeof(tree_record_t), n_nodes, fp) != (size_t) n_nodes ||
+       fread(centers, n_dims * sizeof(double), n_nodes, fp) != (size_t) n_nodes){
+        printf("Tree file is truncated.\n");
+        exit(5);
+    }
+    if(!(flags & TREE_BUCKETS))
+        return;
+
+    if(fread(&count, sizeof(count), 1, fp) != 1 || count < 1){
+        printf("Tree file is truncated.\n");
+        exit(5);
+    }
+    n_points = count;
+    points = (double *) malloc(n_points * n_dims * sizeof(double));
+    if(points == NULL){
+        printf("Error allocating tree, exiting.\n");
+        exit(10);
+    }
+    if(fread(points, n_dims * sizeof(double), n_points, fp) != (size_t) n_points){
+        printf("Tree file is truncated.\n");
+        exit(5);
+    }
+}
+
+void load_tree_bin(FILE *fp, unsigned flags)
+{
+    tree_record_t *records;
+    double *_p_centers;
+    size_t mapped;
+    long i, id;
+
+    if(!(mapped = map_tree_bin(fp, flags)))
+        read_tree_bin(fp, flags);
+
+    // searches only follow the links from record 0, so these are used as is
+    if(flags & (TREE_ID_ORDER | TREE_RECORD_LINKS))
+        return;
+
+    // records are in any order (MPI), move each one to its id
+    records = tree;
+    _p_centers = centers;
+    allocate_tree();
+    for(i = 0; i < n_nodes; i++){
+        id = records[i].id;
+        check_id(id);
+        tree[id] = records[i];
+        memcpy(&centers[id * n_dims], &_p_centers[i * n_dims], n_dims * sizeof(double));
+    }
+
+    if(!mapped){
+        free(records);
+        free(_p_centers);
+    }
+    else if(!points)   // bucket points are still read from the mapping
+        munmap((char *) records - sizeof(tree_header_t), mapped);
+}
+
+/* Reads up to max query points, returns how many were read */
+long read_points(FILE *fp, int format, double *pts, long max)
+{
+    long n;
+    int d, r = 0;
+
+    if(format == FORMAT_BIN)
+        return fread(pts, n_dims * sizeof(double), max, fp);
+
+    for(n = 0; n < max; n++){
+        for(d = 0; d < n_dims; d++){
+            if((r = fscanf(fp, "%lf", &pts[n * n_dims + d])) != 1)
+                break;
+        }
+        if(d == 0 && r == EOF)
+            break;
+        if(d < n_dims){
+            printf("Query point %ld has the wrong number of coordinates.\n", n);
+            exit(6);
+        }
+    }
+    return n;
+}
+
+void compute_gaps()
+{
+    long i;
+
+    gaps = (double *) malloc(n_nodes * sizeof(double));
+    if(gaps == NULL){
+        printf("Error allocating gaps, exiting.\n");
+        exit(4);
+    }
+
+    gaps[0] = 0.0;
+#pragma omp parallel for
+    for(i = 0; i < n_nodes; i++){
+        if(!is_leaf(i)){
+            gaps[tree[i].left] = distance(&centers[i * n_dims], &centers[tree[i].left * n_dims]);
+            gaps[tree[i].right] = distance(&centers[i * n_dims], &centers[tree[i].right * n_dims]);
+        }
+    }
+}
+
+void print_stats()
+{
+    fprintf(stderr, "queries: %ld\n", total_queries);
+    fprintf(stderr, "nodes visited: %ld (%.1f per query)\n",
+            total_visited, (double) total_visited / total_queries);
+    fprintf(stderr, "distance evaluations: %ld (%.1f per query)\n",
+            total_dist_evals, (double) total_dist_evals / total_queries);
+}
+
+/* Each answer's k-th distance is within this factor of the true one,
+ * 1 when the search was exact */
+void print_error()
+{
+    fprintf(stderr, "error bound: %lf worst, %lf mean\n",
+            worst_error, total_error / total_queries);
+}
+
+/* Range results can be huge, so they are streamed one query at a time;
+ * an empty line ends each query's samples */
+void run_range_batch(FILE *fp, int format)
+{
+    double *pts;
+    long i, n;
+
+    pts = (double *) malloc(BATCH_SIZE * n_dims * sizeof(double));
+    if(pts == NULL){
+        printf("Error allocating query points, exiting.\n");
+        exit(4);
+    }
+
+    while((n = read_points(fp, format, pts, BATCH_SIZE)) > 0){
+        for(i = 0; i < n; i++){
+            search_range(stdout, &pts[i * n_dims], 0);
+            printf("\n");
+        }
+    }
+    free(pts);
+}
+
+/* Answers every point in fp, one line each, loading the tree only once.
+ * The tree is read-only, so threads share it and split each batch */
+void run_batch(FILE *fp, int format)
+{
+    double *pts;
+    long *best, *n_found;
+    long n;
+    long batch_size = BATCH_SIZE / k + 1;
+    int n_threads = omp_get_max_threads();
+    char **out = (char **) calloc(n_threads, sizeof(char *));
+    size_t *out_size = (size_t *) calloc(n_threads, sizeof(size_t));
+
+    pts = (double *) malloc(batch_size * n_dims * sizeof(double));
+    best = (long *) malloc(batch_size * k * sizeof(long));
+    n_found = (long *) malloc(batch_size * sizeof(long));
+    if(pts == NULL || best == NULL || n_found == NULL || out == NULL || out_size == NULL){
+        printf("Error allocating query points, exiting.\n");
+        exit(4);
+    }
+
+    while((n = read_points(fp, format, pts, batch_size)) > 0){
+#pragma omp parallel
+        {
+            query_t q;
+            int t = omp_get_thread_num();
+            int n_team = omp_get_num_threads();
+            long i, j;
+
+            double worst = 1.0, sum = 0.0;
+
+            init_query(&q);
+
+            // search cost varies a lot between points
+#pragma omp for schedule(dynamic, 64)
+            for(i = 0; i < n; i++){
+                nearest(&q, &pts[i * n_dims]);
+                worst = fmax(worst, q.error);
+                sum += q.error;
+                n_found[i] = q.n_found;
+                for(j = 0; j < q.n_found; j++)
+                    best[i * k + j] = q.best[j].idx;
+            }
+            free(q.best);
+            free(q.frontier);
+#pragma omp atomic
+            total_visited += q.visited;
+#pragma omp atomic
+            total_dist_evals += q.dist_evals;
+#pragma omp atomic
+            total_error += sum;
+#pragma omp critical
+            worst_error = fmax(worst_error, worst);
+
+            // each thread formats a contiguous slice, written in order below
+            FILE *ms = open_memstream(&out[t], &out_size[t]);
+            for(i = n * t / n_team; i < n * (t + 1) / n_team; i++)
+                for(j = 0; j < n_found[i]; j++)
+                    print_sample(ms, best[i * k + j]);
+            fclose(ms);
+        }
+        total_queries += n;
+
+        for(int t = 0; t < n_threads; t++){
+            if(out[t]){
+                fwrite(out[t], 1, out_size[t], stdout);
+                free(out[t]);
+                out[t] = NULL;
+            }
+        }
+    }
+
+    free(out);
+    free(out_size);
+    free(n_found);
+    free(best);
+    free(pts);
+}
+
+void usage(char *prog)
+{
+    printf("Usage: %s <ball-tree-file> [-k N | -r R] [options] <point>\n", prog);
+    printf("       %s <ball-tree-file> [-k N | -r R] [options] --batch=<file|-> [--batch-format=text|bin]\n", prog);
+    printf("Options: --depth-first --triangle --stats --eps E --max-visits N\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp, *batch_fp = NULL;
+    tree_header_t header;
+    int binary, err, c;
+    int d, i, n_coords = 0;
+    char *batch = NULL;
+    int batch_format = FORMAT_TEXT;
+    double *point;
+    query_t q;
+
+    if(argc < 3)
+        usage(argv[0]);
+
+    // options are removed from argv, leaving the coordinates
+    for(i = 2; i < argc; i++){
+        if(strncmp(argv[i], "--batch=", 8) == 0)
+            batch = argv[i] + 8;
+        else if(strcmp(argv[i], "--batch-format=text") == 0)
+            batch_format = FORMAT_TEXT;
+        else if(strcmp(argv[i], "--batch-format=bin") == 0)
+            batch_format = FORMAT_BIN;
+        else if(strcmp(argv[i], "--depth-first") == 0)
+            depth_first = 1;
+        else if(strcmp(argv[i], "--triangle") == 0)
+            triangle = 1;
+        else if(strcmp(argv[i], "--stats") == 0)
+            stats = 1;
+        else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc){
+            k = atol(argv[++i]);
+            if(k < 1){
+                printf("Illegal number of neighbours (%ld), must be above 0.\n", k);
+                exit(3);
+            }
+        }
+        else if(strcmp(argv[i], "--eps") == 0 && i + 1 < argc){
+            eps = atof(argv[++i]);
+            if(eps < 0.0){
+                printf("Illegal eps (%lf), must not be negative.\n", eps);
+                exit(3);
+            }
+        }
+        else if(strcmp(argv[i], "--max-visits") == 0 && i + 1 < argc){
+            max_visits = atol(argv[++i]);
+            if(max_visits < 1){
+                printf("Illegal visit budget (%ld), must be above 0.\n", max_visits);
+                exit(3);
+            }
+        }
+        else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+            range = atof(argv[++i]);
+            if(range < 0.0){
+                printf("Illegal range (%lf), must not be negative.\n", range);
+                exit(3);
+            }
+        }
+        else if(strncmp(argv[i], "--", 2) == 0)
+            usage(argv[0]);
+        else
+            argv[2 + n_coords++] = argv[i];
+    }
+
+    // range queries are always exact
+    if(range >= 0.0 && (k != 1 || eps > 0.0 || max_visits > 0))
+        usage(argv[0]);
+
+    // left-then-right spends the budget away from the query, leaving its own
+    // ball unexplored, so nothing could be guaranteed
+    if(depth_first && max_visits > 0){
+        printf("--max-visits needs the best-first search, not --depth-first.\n");
         exit(1);
     }
 
@@ -134,21 +859,62 @@ int main(int argc, char *argv[])
         exit(2);
     }
 
-    fscanf(fp, "%d %ld", &n_dims, &n_nodes);
+    // binary trees start with TREE_MAGIC, text trees with a number
+    c = getc(fp);
+    ungetc(c, fp);
+    binary = (c == TREE_MAGIC[0]);
+    if(binary){
+        if((err = read_tree_header(fp, &header)) != 0){
+            printf("Cannot read tree file '%s': %s.\n", argv[1], tree_error(err));
+            exit(2);
+        }
+        n_dims = header.n_dims;
+        n_nodes = header.n_nodes;
+    }
+    else
+        fscanf(fp, "%d %ld", &n_dims, &n_nodes);
     if(n_dims < 2){
         printf("Illegal number of dimensions (%d), must be above 1.\n", n_dims);
         exit(3);
     }
-    if(n_nodes < 2){
-        printf("Illegal number of nodes (%ld), must be above 1.\n", n_nodes);
+    if(n_nodes < 1){
+        printf("Illegal number of nodes (%ld), must be above 0.\n", n_nodes);
         exit(2);
     }
 
-    if(argc != n_dims + 2){
+    if(batch){
+        if(n_coords != 0)
+            usage(argv[0]);
+        batch_fp = strcmp(batch, "-") == 0 ? stdin : fopen(batch, "r");
+        if(batch_fp == NULL){
+            printf("Cannot open query file '%s'.\n", batch);
+            exit(2);
+        }
+    }
+    else if(n_coords != n_dims){
         printf("Wrong number of coordinates for <point>\n");
         exit(3);
     }
 
+    if(binary)
+        load_tree_bin(fp, header.flags);
+    else
+        load_tree_text(fp);
+    if(triangle)
+        compute_gaps();
+
+    if(batch){
+        if(range >= 0.0)
+            run_range_batch(batch_fp, batch_format);
+        else
+            run_batch(batch_fp, batch_format);
+        if(stats && range < 0.0)
+            print_stats();
+        if(eps > 0.0 || max_visits > 0)
+            print_error();
+        return 0;
+    }
+
     point = (double *) malloc(n_dims * sizeof(double));
     if(point == NULL){
         printf("Error allocating point, exiting.\n");
@@ -157,22 +923,23 @@ int main(int argc, char *argv[])
     for(d = 0; d < n_dims; d++)
         point[d] = atof(argv[d + 2]);
 
-    allocate_hash();
-    allocate_tree();
-    for(i = 0; i < n_nodes; i++){
-        fscanf(fp, "%ld", &node_idx);
-	hash_insert(node_idx, i);
-        node = &(tree[i]);
-        fscanf(fp, "%ld %ld %lf", &(node->L), &(node->R), &(node->radius));
-        for(d = 0; d < n_dims; d++)
-            fscanf(fp, "%lf", &(center[i][d]));
+    if(range >= 0.0){
+        search_range(stdout, point, 0);
+        return 0;
     }
 
-    // tree and point are global, index 0 is root; currBest has result
-    search_tree(hash_get_index(0));
+    init_query(&q);
+    nearest(&q, point);
     
-    // print closest sample
-    for(d = 0; d < n_dims; d++)
-        printf("%lf ", center[currBest][d]);
-    printf("\n");
+    // print closest samples
+    for(i = 0; i < q.n_found; i++)
+        print_sample(stdout, q.best[i].idx);
+
+    total_queries = 1;
+    total_visited = q.visited;
+    total_dist_evals = q.dist_evals;
+    if(stats)
+        print_stats();
+    if(eps > 0.0 || max_visits > 0)
+        fprintf(stderr, "error bound: %lf\n", q.error);
 }
@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gen_points.h"
 
 #define RANGE 10
+#define N_CLUSTERS 16         /* centers of the clustered distribution */
+#define CLUSTER_SPREAD 0.2    /* side of the box around each center */
+#define DUPLICATE_STEPS 4     /* grid steps per axis of the duplicated distribution */
 
 void print_point(double *point, int n_dims) {
     int i;
@@ -31,6 +37,65 @@ double **create_array_pts(int n_dims, long np)
 }
 
 
+/* Returns the distribution selected by a --points=<uniform|clustered|duplicates>
+ * argument, -1 if invalid */
+int parse_distribution(const char *arg)
+{
+    if (strcmp(arg, "--points=uniform") == 0)
+        return POINTS_UNIFORM;
+    if (strcmp(arg, "--points=clustered") == 0)
+        return POINTS_CLUSTERED;
+    if (strcmp(arg, "--points=duplicates") == 0)
+        return POINTS_DUPLICATES;
+    return -1;
+}
+
+static int get_distribution(int argc, char *argv[])
+{
+    int dist = POINTS_UNIFORM;
+
+    for (int i = 4; i < argc; i++)
+        if (parse_distribution(argv[i]) >= 0)
+            dist = parse_distribution(argv[i]);
+    return dist;
+}
+
+/* Cluster centers come from their own generator, so every point still takes
+ * exactly n_dims values from random() and a process can skip to its share */
+static double *get_centers(int n_dims, int seed, int dist)
+{
+    unsigned short state[3] = {0x330e, seed & 0xffff, (seed >> 16) & 0xffff};
+    double *centers;
+
+    if (dist != POINTS_CLUSTERED)
+        return NULL;
+    centers = (double *) malloc(N_CLUSTERS * n_dims * sizeof(double));
+    if(centers == NULL){
+        printf("Error allocating array of points, exiting.\n");
+        exit(4);
+    }
+    for (int c = 0; c < N_CLUSTERS * n_dims; c++)
+        centers[c] = RANGE * erand48(state);
+    return centers;
+}
+
+/* Coordinate j of point i (counted over the whole set) */
+static double get_coordinate(int dist, double *centers, int n_dims, long i, int j)
+{
+    double x = random();
+
+    switch (dist) {
+        case POINTS_CLUSTERED:
+            /* scatter consecutive points over the clusters */
+            return centers[(i * 2654435761ul >> 8) % N_CLUSTERS * n_dims + j]
+                + CLUSTER_SPREAD * (x / RAND_MAX - 0.5);
+        case POINTS_DUPLICATES:
+            return RANGE * floor(DUPLICATE_STEPS * x / RAND_MAX) / DUPLICATE_STEPS;
+        default:
+            return RANGE * x / RAND_MAX;
+    }
+}
+
 void consume_rand(int n) {
     for (int i = 0; i < n; i++) {
         random();
@@ -46,16 +111,20 @@ double **get_points(int argc, char *argv[], int *n_dims, long *np, long n_consum
     pt_arr = (double **) create_array_pts(*n_dims + 1, *np);
 
     int seed = atoi(argv[3]);
+    int dist = get_distribution(argc, argv);
+    double *centers = get_centers(*n_dims, seed, dist);
+    long first = n_consumes / *n_dims;
     srandom(seed);
 
     consume_rand(n_consumes);
 
     for(i = 0; i < *np; i++) {
         for(j = 0; j < *n_dims; j++)
-            pt_arr[i][j] = RANGE * ((double) random()) / RAND_MAX;
+            pt_arr[i][j] = get_coordinate(dist, centers, *n_dims, first + i, j);
         if (index_dim)
             pt_arr[i][j] = i + (int) (n_consumes / *n_dims);
     }
+    free(centers);
 
     if (index_dim)
         (*n_dims)++;
@@ -68,3 +137,30 @@ double **get_points(int argc, char *argv[], int *n_dims, long *np, long n_consum
 
     return pt_arr;
 }
+
+/* Same points as get_points, stored dimension-major: coordinate j of
+ * point i is at pt_arr[j * np + i] */
+double *get_points_soa(int argc, char *argv[], int *n_dims, long *np)
+{
+    double *pt_arr;
+    long i;
+    int j;
+
+    pt_arr = (double *) malloc(*n_dims * *np * sizeof(double));
+    if(pt_arr == NULL){
+        printf("Error allocating array of points, exiting.\n");
+        exit(4);
+    }
+
+    int seed = atoi(argv[3]);
+    int dist = get_distribution(argc, argv);
+    double *centers = get_centers(*n_dims, seed, dist);
+    srandom(seed);
+
+    for(i = 0; i < *np; i++)
+        for(j = 0; j < *n_dims; j++)
+            pt_arr[j * *np + i] = get_coordinate(dist, centers, *n_dims, i, j);
+    free(centers);
+
+    return pt_arr;
+}
@@ -1,7 +1,16 @@
 #ifndef GEN_POINTS_H
 #define GEN_POINTS_H
 
+enum distributions {
+    POINTS_UNIFORM = 0,
+    POINTS_CLUSTERED = 1,
+    POINTS_DUPLICATES = 2
+};
+
+int parse_distribution(const char *arg);
+
 double **get_points(int argc, char *argv[], int *n_dims, long *np, long n_consumes, int index_dim);
+double *get_points_soa(int argc, char *argv[], int *n_dims, long *np);
 void print_point(double *point, int n_dims);
 
 #endif
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+enum kernel_levels {
+    KERNELS_SCALAR = 0,
+    KERNELS_AVX2,
+    KERNELS_AVX512
+};
+
+static const char *kernel_names[] = {"scalar", "avx2", "avx512"};
+
+#pragma region scalar
+
+static void distances_scalar(const double *pts, long stride, int n_dims,
+                             const double *p, long l, long r, double *out)
+{
+    long i;
+
+    for (i = l; i < r + 1; i++)
+        out[i] = 0.0;
+    for (int d = 0; d < n_dims; d++)
+    {
+        const double *x = &pts[d * stride];
+        double pd = p[d];
+
+        for (i = l; i < r + 1; i++)
+            out[i] += (pd - x[i]) * (pd - x[i]);
+    }
+}
+
+static void project_scalar(const double *pts, long stride, int n_dims,
+                           const double *a, const double *factor,
+                           long l, long r, double *key)
+{
+    long i;
+
+    for (i = l; i < r + 1; i++)
+        key[i] = 0.0;
+    for (int d = 0; d < n_dims; d++)
+    {
+        const double *x = &pts[d * stride];
+        double ad = a[d], fd = factor[d];
+
+        for (i = l; i < r + 1; i++)
+            key[i] += (x[i] - ad) * fd;
+    }
+}
+
+#pragma endregion
+
+#ifdef HAVE_X86_KERNELS
+
+#define AVX2 __attribute__((target("avx2")))
+#define AVX512 __attribute__((target("avx512f")))
+#define BODY __attribute__((always_inline)) static inline
+
+/*
+ * Each kernel body is stamped out once per dimensionality in
+ * specialized_dims, where n_dims is a constant: the loop over coordinates
+ * unrolls and the pivot stays in registers. The _any copy takes n_dims at
+ * run time
+ */
+#define DISTANCE_VARIANT(body, attr, suffix, dims)                                   \
+    attr static void body##suffix(const double *pts, long stride, int n_dims,        \
+                                  const double *p, long l, long r, double *out)      \
+    {                                                                                \
+        body(pts, stride, dims, p, l, r, out);                                       \
+    }
+
+#define PROJECT_VARIANT(body, attr, suffix, dims)                                    \
+    attr static void body##suffix(const double *pts, long stride, int n_dims,        \
+                                  const double *a, const double *factor,             \
+                                  long l, long r, double *key)                       \
+    {                                                                                \
+        body(pts, stride, dims, a, factor, l, r, key);                               \
+    }
+
+#define VARIANTS(variant, body, attr)     \
+    variant(body, attr, _any, n_dims)     \
+    variant(body, attr, _2, 2)            \
+    variant(body, attr, _3, 3)            \
+    variant(body, attr, _4, 4)            \
+    variant(body, attr, _20, 20)
+
+#define VARIANT_TABLE(body) {body##_any, body##_2, body##_3, body##_4, body##_20}
+
+static const int specialized_dims[] = {0, 2, 3, 4, 20};
+
+#pragma region avx2
+
+/* Each lane is one point, so a point's terms are still added in order;
+ * the tail that doesn't fill a vector goes to the scalar kernel */
+AVX2 BODY void distances_avx2(const double *restrict pts, long stride, int n_dims,
+                              const double *restrict p, long l, long r, double *restrict out)
+{
+    long i;
+
+    for (i = l; i + 3 <= r; i += 4)
+    {
+        __m256d acc = _mm256_setzero_pd();
+
+        for (int d = 0; d < n_dims; d++)
+        {
+            __m256d diff = _mm256_sub_pd(_mm256_set1_pd(p[d]), _mm256_loadu_pd(&pts[d * stride + i]));
+            acc = _mm256_add_pd(acc, _mm256_mul_pd(diff, diff));
+        }
+        _mm256_storeu_pd(&out[i], acc);
+    }
+    distances_scalar(pts, stride, n_dims, p, i, r, out);
+}
+
+AVX2 BODY void project_avx2(const double *restrict pts, long stride, int n_dims,
+                            const double *restrict a, const double *restrict factor,
+                            long l, long r, double *restrict key)
+{
+    long i;
+
+    for (i = l; i + 3 <= r; i += 4)
+    {
+        __m256d t = _mm256_setzero_pd();
+
+        for (int d = 0; d < n_dims; d++)
+        {
+            __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(&pts[d * stride + i]), _mm256_set1_pd(a[d]));
+            t = _mm256_add_pd(t, _mm256_mul_pd(diff, _mm256_set1_pd(factor[d])));
+        }
+        _mm256_storeu_pd(&key[i], t);
+    }
+    project_scalar(pts, stride, n_dims, a, factor, i, r, key);
+}
+
+VARIANTS(DISTANCE_VARIANT, distances_avx2, AVX2)
+VARIANTS(PROJECT_VARIANT, project_avx2, AVX2)
+
+#pragma endregion
+
+#pragma region avx512
+
+AVX512 BODY void distances_avx512(const double *restrict pts, long stride, int n_dims,
+                                  const double *restrict p, long l, long r, double *restrict out)
+{
+    long i;
+
+    for (i = l; i + 7 <= r; i += 8)
+    {
+        __m512d acc = _mm512_setzero_pd();
+
+        for (int d = 0; d < n_dims; d++)
+        {
+            __m512d diff = _mm512_sub_pd(_mm512_set1_pd(p[d]), _mm512_loadu_pd(&pts[d * stride + i]));
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+        }
+        _mm512_storeu_pd(&out[i], acc);
+    }
+    distances_avx2_any(pts, stride, n_dims, p, i, r, out);
+}
+
+AVX512 BODY void project_avx512(const double *restrict pts, long stride, int n_dims,
+                                const double *restrict a, const double *restrict factor,
+                                long l, long r, double *restrict key)
+{
+    long i;
+
+    for (i = l; i + 7 <= r; i += 8)
+    {
+        __m512d t = _mm512_setzero_pd();
+
+        for (int d = 0; d < n_dims; d++)
+        {
+            __m512d diff = _mm512_sub_pd(_mm512_loadu_pd(&pts[d * stride + i]), _mm512_set1_pd(a[d]));
+            t = _mm512_add_pd(t, _mm512_mul_pd(diff, _mm512_set1_pd(factor[d])));
+        }
+        _mm512_storeu_pd(&key[i], t);
+    }
+    project_avx2_any(pts, stride, n_dims, a, factor, i, r, key);
+}
+
+VARIANTS(DISTANCE_VARIANT, distances_avx512, AVX512)
+VARIANTS(PROJECT_VARIANT, project_avx512, AVX512)
+
+#pragma endregion
+
+static const distance_kernel_t distance_kernels[][5] = {
+    [KERNELS_AVX2] = VARIANT_TABLE(distances_avx2),
+    [KERNELS_AVX512] = VARIANT_TABLE(distances_avx512)
+};
+static const project_kernel_t project_kernels[][5] = {
+    [KERNELS_AVX2] = VARIANT_TABLE(project_avx2),
+    [KERNELS_AVX512] = VARIANT_TABLE(project_avx512)
+};
+
+#endif
+
+distance_kernel_t distance_kernel = distances_scalar;
+project_kernel_t project_kernel = project_scalar;
+
+static int supported_level(void)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return KERNELS_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return KERNELS_AVX2;
+#endif
+    return KERNELS_SCALAR;
+}
+
+const char *init_kernels(int n_dims)
+{
+    const char *wanted = getenv("BALL_SIMD");
+    int level = supported_level();
+
+    for (int i = KERNELS_SCALAR; wanted && i < level; i++)
+        if (strcmp(wanted, kernel_names[i]) == 0)
+            level = i;
+
+    distance_kernel = distances_scalar;
+    project_kernel = project_scalar;
+#ifdef HAVE_X86_KERNELS
+    if (level != KERNELS_SCALAR)
+    {
+        int v = 0;
+
+        for (int i = 1; i < 5; i++)
+            if (specialized_dims[i] == n_dims)
+                v = i;
+        distance_kernel = distance_kernels[level][v];
+        project_kernel = project_kernels[level][v];
+    }
+#endif
+    return kernel_names[level];
+}
@@ -0,0 +1,28 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+/*
+ * Sweeps of one pivot against a range of points, for dimension-major point
+ * sets: coordinate d of the point at position i is pts[d * stride + i].
+ * Every variant adds the coordinates in the same order, without fused
+ * multiply-adds, so they all give the same bits as the scalar loops.
+ */
+
+/* out[i] = squared distance from p to the point at position i, for l..r */
+typedef void (*distance_kernel_t)(const double *pts, long stride, int n_dims,
+                                  const double *p, long l, long r, double *out);
+
+/* key[i] = (x_i - a) . factor, the position of x_i along a line through a */
+typedef void (*project_kernel_t)(const double *pts, long stride, int n_dims,
+                                 const double *a, const double *factor,
+                                 long l, long r, double *key);
+
+extern distance_kernel_t distance_kernel;
+extern project_kernel_t project_kernel;
+
+/* Picks the widest kernels the CPU supports, or those named in BALL_SIMD
+ * (scalar, avx2 or avx512), specialized for n_dims when there is a copy for
+ * it; returns the name of the instruction set chosen */
+const char *init_kernels(int n_dims);
+
+#endif
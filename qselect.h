@@ -0,0 +1,169 @@
+#ifndef QSELECT_H
+#define QSELECT_H
+
+/*
+ * Selection engine shared by the builders. The including file defines
+ *   SELECT_KEY(i)      the key at index i, a double
+ *   SELECT_SWAP(i, j)  exchanges the keys at i and j and whatever moves with them
+ * before including this header.
+ *
+ * select_kth puts the k-th smallest key of l..r at k, no greater ones before
+ * it and no smaller ones after. Pivots come from a Floyd-Rivest sample on
+ * large ranges and a median of three on small ones; partitioning is
+ * three-way, so runs of equal keys are settled in one pass. Once the work
+ * done exceeds a few times the range size, pivots switch to the median of
+ * medians, which bounds the worst case to linear time.
+ */
+
+#include <math.h>
+
+#define SELECT_SAMPLE_MIN 600 /* ranges from this size on pick pivots from a sample */
+#define SELECT_WORK_FACTOR 4  /* partition work allowed, per point, before the fallback */
+
+static double select_kth(long l, long r, long k);
+static long select_kth_linear(long l, long r, long k);
+
+/* Three-way partition of l..r around the key at p: on return l..*lt-1 are
+ * smaller, *lt..*gt equal and *gt+1..r greater. Equal keys met on the way
+ * are parked at the ends and swapped to the middle at the end */
+static void select_partition(long l, long r, long p, long *lt, long *gt)
+{
+    long i = l - 1, j = r, e_left = l - 1, e_right = r, s;
+    double v;
+
+    SELECT_SWAP(p, r);
+    v = SELECT_KEY(r);
+    while (1)
+    {
+        while (SELECT_KEY(++i) < v)
+            ;
+        while (v < SELECT_KEY(--j))
+            if (j == l)
+                break;
+        if (i >= j)
+            break;
+        SELECT_SWAP(i, j);
+        if (SELECT_KEY(i) == v)
+        {
+            e_left++;
+            SELECT_SWAP(e_left, i);
+        }
+        if (SELECT_KEY(j) == v)
+        {
+            e_right--;
+            SELECT_SWAP(j, e_right);
+        }
+    }
+
+    SELECT_SWAP(i, r);
+    j = i - 1;
+    i = i + 1;
+    for (s = l; s <= e_left; s++, j--)
+        SELECT_SWAP(s, j);
+    for (s = r - 1; s >= e_right; s--, i++)
+        SELECT_SWAP(i, s);
+    *lt = j + 1;
+    *gt = i - 1;
+}
+
+/* Sorts the keys at l..r, for groups of a few */
+static void select_insertion_sort(long l, long r)
+{
+    for (long i = l + 1; i <= r; i++)
+        for (long j = i; j > l && SELECT_KEY(j) < SELECT_KEY(j - 1); j--)
+            SELECT_SWAP(j, j - 1);
+}
+
+static long select_median_of_three(long l, long r)
+{
+    long m = (l + r) / 2;
+
+    if (SELECT_KEY(r) < SELECT_KEY(l))
+        SELECT_SWAP(r, l);
+    if (SELECT_KEY(m) < SELECT_KEY(l))
+        SELECT_SWAP(m, l);
+    if (SELECT_KEY(r) < SELECT_KEY(m))
+        SELECT_SWAP(r, m);
+    return m;
+}
+
+/* Median of the medians of groups of five, which has at least 3/10 of the
+ * keys on each side; the medians are gathered at the front of l..r */
+static long select_median_of_medians(long l, long r)
+{
+    long m = l;
+
+    if (r - l < 5)
+    {
+        select_insertion_sort(l, r);
+        return (l + r) / 2;
+    }
+    for (long g = l; g + 4 <= r; g += 5, m++)
+    {
+        select_insertion_sort(g, g + 4);
+        SELECT_SWAP(g + 2, m);
+    }
+    return select_kth_linear(l, m - 1, l + (m - 1 - l) / 2);
+}
+
+/* Narrows l..r around k with the given pivot rule until k is settled;
+ * work is the number of keys partitioned so far, limit when to give up */
+static long select_narrow(long *l, long *r, long k, long *work, long limit, int linear)
+{
+    long p, lt, gt;
+
+    while (*r > *l)
+    {
+        if (linear || *work > limit)
+            p = select_median_of_medians(*l, *r);
+        else if (*r - *l + 1 >= SELECT_SAMPLE_MIN)
+        {
+            /* Floyd-Rivest: select k within a sample around where it
+             * should be, so the pivot lands very close to the k-th key */
+            double n = *r - *l + 1, i = k - *l + 1;
+            double z = log(n);
+            double s = 0.5 * exp(2 * z / 3);
+            double sd = 0.5 * sqrt(z * s * (n - s) / n) * (i < n / 2 ? -1 : 1);
+            long sample_l = (long) fmax(*l, k - i * s / n + sd);
+            long sample_r = (long) fmin(*r, k + (n - i) * s / n + sd);
+            long stride = (*r - *l + 1) / (sample_r - sample_l + 1);
+
+            /* the sample is spread over the whole range, so sorted or
+             * patterned input doesn't bias it */
+            for (long step = 0; step <= sample_r - sample_l; step++)
+                SELECT_SWAP(sample_l + step, *l + step * stride);
+            select_kth(sample_l, sample_r, k);
+            p = k;
+        }
+        else
+            p = select_median_of_three(*l, *r);
+
+        *work += *r - *l + 1;
+        select_partition(*l, *r, p, &lt, &gt);
+        if (k < lt)
+            *r = lt - 1;
+        else if (k > gt)
+            *l = gt + 1;
+        else
+            break;
+    }
+    return k;
+}
+
+/* Median-of-medians selection only, worst-case linear */
+static long select_kth_linear(long l, long r, long k)
+{
+    long work = 0;
+
+    return select_narrow(&l, &r, k, &work, 0, 1);
+}
+
+static double select_kth(long l, long r, long k)
+{
+    long work = 0;
+
+    select_narrow(&l, &r, k, &work, SELECT_WORK_FACTOR * (r - l + 1), 0);
+    return SELECT_KEY(k);
+}
+
+#endif
@@ -6,6 +6,16 @@
 # no-color: print output uncolored
 # no-compact: print the output of each test to the console
 # no-clean: keep all the logs
+# bin: build the trees in the binary format
+# veb: build binary trees in van Emde Boas order (serial and OpenMP builders)
+#
+# A test's .in holds the builder's arguments, its .query the query's, options
+# such as -k N or -r R included; a --batch file is named relative to the
+# tests folder, where they run. Range results come in tree order, so they
+# are compared sorted. What the query prints to stderr, such as the error bound
+# of an approximate search, is compared too. A budgeted search answers from the
+# part of the tree it reached, and the MPI builder splits its own way, so
+# expected/<test>.mpi.query.out, when there is one, holds its output
 
 # Set the path to the folder with the tests
 TESTS_PATH="tests"
@@ -22,6 +32,7 @@ QUERY="../ballQuery"
 CLEAN=true
 COMPACT=false
 COLOR=true
+FORMAT=""
 
 if [ $# -ne 0 ]; then
     for i in $@
@@ -36,6 +47,12 @@ if [ $# -ne 0 ]; then
             "no-color")
                 COLOR=false
                 ;;
+            "bin")
+                FORMAT="--format=bin"
+                ;;
+            "veb")
+                FORMAT="--format=bin --layout=veb"
+                ;;
             *)
                 echo "Unknown option ${BOLD}$i${RESET}"
                 ;;
@@ -78,12 +95,15 @@ do
     rm expected/${util}.query.mine &> /dev/null
 
     if [ $(echo $PROG | grep mpi) ]; then
-        ${QUERY} <(mpirun --use-hwthread-cpus -n 4 $PROG $(cat ${file}) 2> /dev/null) $(cat ${util}.query) 2>/dev/null > expected/${util}.query.mine
+        ${QUERY} <(mpirun --use-hwthread-cpus -n 4 $PROG $(cat ${file}) $FORMAT 2> /dev/null) $(cat ${util}.query) > expected/${util}.query.mine 2>&1
     else
-        ${QUERY} <($PROG $(cat ${file}) 2> /dev/null) $(cat ${util}.query) 2>/dev/null > expected/${util}.query.mine
+        ${QUERY} <($PROG $(cat ${file}) $FORMAT 2> /dev/null) $(cat ${util}.query) > expected/${util}.query.mine 2>&1
     fi
 
     if [ $? -eq 0 ]; then
+        if grep -qE -- "(^| )-r " ${util}.query; then
+            LC_ALL=C sort -o expected/${util}.query.mine expected/${util}.query.mine
+        fi
         echo "DONE"
     else
         echo -e "FAILED\n"
@@ -94,7 +114,11 @@ do
     fi
 
     echo -n "Comparing outputs... "
-    if [ "$(diff -q -b expected/${util}.query.out expected/${util}.query.mine)" != "" ]; then
+    expected=expected/${util}.query.out
+    if [ $(echo $PROG | grep mpi) ] && [ -f expected/${util}.mpi.query.out ]; then
+        expected=expected/${util}.mpi.query.out
+    fi
+    if [ "$(diff -q -b $expected expected/${util}.query.mine)" != "" ]; then
         echo -e "DIFFERENT\n"
         if [ "$COMPACT" = true ]; then
             clean_lines_up 3
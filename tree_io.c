@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "tree_io.h"
+
+enum tree_errors {
+    TREE_OK = 0,
+    TREE_SHORT,
+    TREE_BAD_MAGIC,
+    TREE_BAD_VERSION,
+    TREE_BAD_ENDIAN
+};
+
+/* Returns the format selected by a --format=<text|bin> argument, -1 if invalid */
+int parse_format(const char *arg)
+{
+    if (strcmp(arg, "--format=text") == 0)
+        return FORMAT_TEXT;
+    if (strcmp(arg, "--format=bin") == 0)
+        return FORMAT_BIN;
+    return -1;
+}
+
+/* Returns the layout selected by a --layout=<id|veb> argument, -1 if invalid */
+int parse_layout(const char *arg)
+{
+    if (strcmp(arg, "--layout=id") == 0)
+        return LAYOUT_ID;
+    if (strcmp(arg, "--layout=veb") == 0)
+        return LAYOUT_VEB;
+    return -1;
+}
+
+/* Returns the leaf size given by a --leaf-size=<B> argument, -1 if it isn't one
+ * and 0 if B is not a positive number */
+long parse_leaf_size(const char *arg)
+{
+    char *end;
+    long leaf_size;
+
+    if (strncmp(arg, "--leaf-size=", 12) != 0)
+        return -1;
+    leaf_size = strtol(arg + 12, &end, 10);
+    return *end == '\0' && leaf_size > 0 ? leaf_size : 0;
+}
+
+/* Number of nodes of the subtrees over n and n + 1 points. Siblings differ by
+ * at most one point, so the halves of n and n + 1 are both n / 2 or n / 2 + 1
+ * and the counts follow from those of n / 2, one level at a time */
+static void count_nodes(long n, long leaf_size, long *nodes, long *next_nodes)
+{
+    long half, next_half;
+
+    if (n + 1 <= leaf_size) {
+        *nodes = *next_nodes = 1;
+        return;
+    }
+    count_nodes(n / 2, leaf_size, &half, &next_half);
+    if (n % 2 == 0) {
+        *nodes = 1 + 2 * half;
+        *next_nodes = 1 + half + next_half;
+    } else {
+        *nodes = 1 + half + next_half;
+        *next_nodes = 1 + 2 * next_half;
+    }
+    if (n <= leaf_size)
+        *nodes = 1;
+}
+
+/* Nodes of the implicit tree over size points with leaves of up to leaf_size */
+long tree_nodes(long size, long leaf_size)
+{
+    long nodes, next_nodes;
+
+    if (leaf_size == 1)
+        return 2 * size - 1;
+    count_nodes(size, leaf_size, &nodes, &next_nodes);
+    return nodes;
+}
+
+/* Levels of the implicit tree over size points; the right half is the larger */
+static int tree_height(long size, long leaf_size)
+{
+    int height = 1;
+
+    for (; size > leaf_size; size -= size / 2)
+        height++;
+    return height;
+}
+
+typedef void (*visit_t)(long id, long first, long size);
+
+static void veb_bottom(long id, long first, long size, int depth, int height, long leaf_size, visit_t visit);
+
+/* Visits the top height levels of the subtree at id, over the points from
+ * first on, in van Emde Boas order: the upper half of those levels first,
+ * then each subtree hanging below it, all laid out the same way. Any path
+ * from the root then crosses O(log_B N) blocks of B records, whatever B is */
+static void veb_subtree(long id, long first, long size, int height, long leaf_size, visit_t visit)
+{
+    int top = height / 2;
+
+    if (height == 1 || size <= leaf_size) {
+        visit(id, first, size);
+        return;
+    }
+    veb_subtree(id, first, size, top, leaf_size, visit);
+    veb_bottom(id, first, size, top, height - top, leaf_size, visit);
+}
+
+/* Visits, left to right, the subtrees rooted depth levels below id */
+static void veb_bottom(long id, long first, long size, int depth, int height, long leaf_size, visit_t visit)
+{
+    if (depth == 0) {
+        veb_subtree(id, first, size, height, leaf_size, visit);
+        return;
+    }
+    if (size <= leaf_size)  /* a leaf above the cut, visited with the top */
+        return;
+    veb_bottom(left_child(id, size, leaf_size), first, size / 2, depth - 1, height, leaf_size, visit);
+    veb_bottom(right_child(id, size, leaf_size), first + size / 2, size - size / 2,
+               depth - 1, height, leaf_size, visit);
+}
+
+/* Calls visit on every node of the implicit tree over n_points, in van Emde
+ * Boas order, with the position of its first point and how many it has; the
+ * root comes first */
+void veb_order(long n_points, long leaf_size, visit_t visit)
+{
+    veb_subtree(0, 0, n_points, tree_height(n_points, leaf_size), leaf_size, visit);
+}
+
+void write_tree_header(FILE *fp, int n_dims, long n_nodes, unsigned flags)
+{
+    tree_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TREE_MAGIC, sizeof(header.magic));
+    header.version = TREE_VERSION;
+    header.endian = TREE_ENDIAN_TAG;
+    header.flags = flags;
+    header.n_dims = n_dims;
+    header.n_nodes = n_nodes;
+
+    fwrite(&header, sizeof(header), 1, fp);
+}
+
+int read_tree_header(FILE *fp, tree_header_t *header)
+{
+    if (fread(header, sizeof(*header), 1, fp) != 1)
+        return TREE_SHORT;
+    if (memcmp(header->magic, TREE_MAGIC, sizeof(header->magic)) != 0)
+        return TREE_BAD_MAGIC;
+    if (header->endian != TREE_ENDIAN_TAG)
+        return TREE_BAD_ENDIAN;
+    if (header->version != TREE_VERSION)
+        return TREE_BAD_VERSION;
+    return TREE_OK;
+}
+
+/* The implicit tree being written by dump_tree_bin or dump_tree_veb, for
+ * the functions veb_order visits */
+static struct {
+    FILE *fp;
+    int n_dims;
+    long n_points;
+    long leaf_size;
+    const double *radii;
+    const double *centers;
+    point_t point;
+    long *veb_index;    /* record index of each node in the van Emde Boas layout */
+    long n_indexed;
+} dump;
+
+static void start_dump(FILE *fp, int n_dims, long n_points, long leaf_size,
+                       const double *radii, const double *centers, point_t point)
+{
+    dump.fp = fp;
+    dump.n_dims = n_dims;
+    dump.n_points = n_points;
+    dump.leaf_size = leaf_size;
+    dump.radii = radii;
+    dump.centers = centers;
+    dump.point = point;
+}
+
+/* Header flags for the layout flags given; bucket leaves add TREE_BUCKETS */
+static unsigned tree_flags(unsigned flags)
+{
+    return dump.leaf_size > 1 ? flags | TREE_BUCKETS : flags;
+}
+
+/* Writes the records of the subtree rooted at id, over the points from
+ * first on, in preorder, which is id order */
+static void write_records(long id, long first, long size)
+{
+    long leaf_size = dump.leaf_size;
+    tree_record_t record;
+
+    record.id = id;
+    record.left = left_child(id, size, leaf_size);
+    record.right = right_child(id, size, leaf_size);
+    record.radius = dump.radii[id];
+    if (size <= leaf_size && leaf_size > 1)
+        set_bucket(&record, first, size);
+    fwrite(&record, sizeof(record), 1, dump.fp);
+
+    if (size > leaf_size) {
+        write_records(left_child(id, size, leaf_size), first, size / 2);
+        write_records(right_child(id, size, leaf_size), first + size / 2, size - size / 2);
+    }
+}
+
+/* Bucket leaves own ranges of positions, so the points go in position
+ * order, a point per row */
+static void write_points(void)
+{
+    int n_dims = dump.n_dims;
+    int64_t count = dump.n_points;
+    long rows = 4096;
+    double *block = (double *) malloc(rows * n_dims * sizeof(double));
+    assert(block);
+
+    fwrite(&count, sizeof(count), 1, dump.fp);
+    for (long first = 0; first < dump.n_points; first += rows) {
+        long n = dump.n_points - first < rows ? dump.n_points - first : rows;
+
+        for (long i = 0; i < n; i++)
+            dump.point(first + i, &block[i * n_dims]);
+        fwrite(block, n_dims * sizeof(double), n, dump.fp);
+    }
+    free(block);
+}
+
+/* Writes the implicit tree over n_points with the records by node id; radii
+ * and centers are indexed by id, and point gives the point at a position */
+void dump_tree_bin(FILE *fp, int n_dims, long n_points, long leaf_size,
+                   const double *radii, const double *centers, point_t point)
+{
+    long n_nodes = tree_nodes(n_points, leaf_size);
+
+    start_dump(fp, n_dims, n_points, leaf_size, radii, centers, point);
+    write_tree_header(fp, n_dims, n_nodes, tree_flags(TREE_ID_ORDER));
+    write_records(0, 0, n_points);
+    /* Centers are stored by id, so that array can be written as is */
+    fwrite(centers, sizeof(double), n_nodes * n_dims, fp);
+    if (leaf_size > 1)
+        write_points();
+}
+
+static void index_node(long id, long first, long size)
+{
+    dump.veb_index[id] = dump.n_indexed++;
+}
+
+static void write_veb_record(long id, long first, long size)
+{
+    long leaf_size = dump.leaf_size;
+    tree_record_t record;
+
+    record.id = id;
+    record.left = size > leaf_size ? dump.veb_index[left_child(id, size, leaf_size)] : -1;
+    record.right = size > leaf_size ? dump.veb_index[right_child(id, size, leaf_size)] : -1;
+    record.radius = dump.radii[id];
+    if (size <= leaf_size && leaf_size > 1)
+        set_bucket(&record, first, size);
+    fwrite(&record, sizeof(record), 1, dump.fp);
+}
+
+static void write_veb_center(long id, long first, long size)
+{
+    fwrite(&dump.centers[id * dump.n_dims], sizeof(double), dump.n_dims, dump.fp);
+}
+
+/* As dump_tree_bin, but the records, and their centers, go in van Emde Boas
+ * order, with the children given as record indices; a search then reads few
+ * blocks per path. Bucket points stay in position order */
+void dump_tree_veb(FILE *fp, int n_dims, long n_points, long leaf_size,
+                   const double *radii, const double *centers, point_t point)
+{
+    long n_nodes = tree_nodes(n_points, leaf_size);
+
+    start_dump(fp, n_dims, n_points, leaf_size, radii, centers, point);
+    dump.veb_index = (long *) malloc(n_nodes * sizeof(long));
+    assert(dump.veb_index);
+    dump.n_indexed = 0;
+    veb_order(n_points, leaf_size, index_node);
+
+    write_tree_header(fp, n_dims, n_nodes, tree_flags(TREE_RECORD_LINKS));
+    veb_order(n_points, leaf_size, write_veb_record);
+    veb_order(n_points, leaf_size, write_veb_center);
+    if (leaf_size > 1)
+        write_points();
+    free(dump.veb_index);
+}
+
+const char *tree_error(int err)
+{
+    switch (err) {
+        case TREE_OK:
+            return "no error";
+        case TREE_SHORT:
+            return "file is truncated";
+        case TREE_BAD_MAGIC:
+            return "not a ball-tree file";
+        case TREE_BAD_VERSION:
+            return "unsupported format version";
+        case TREE_BAD_ENDIAN:
+            return "tree was written with a different byte order";
+        default:
+            return "unknown error";
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef TREE_IO_H
+#define TREE_IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Binary ball-tree file:
+ *   tree_header_t
+ *   tree_record_t[n_nodes]
+ *   double[n_nodes][n_dims]    (center of record i)
+ *   int64_t n_points, double[n_points][n_dims]   (only with TREE_BUCKETS)
+ * Everything is written in the byte order of the machine that built the tree.
+ */
+
+#define TREE_MAGIC "BALLTREE"
+#define TREE_VERSION 1
+#define TREE_ENDIAN_TAG 0x01020304u
+
+/* Layout flags */
+#define TREE_ID_ORDER 0x1     /* record i holds node id i */
+#define TREE_RECORD_LINKS 0x2 /* left and right are record indices, the root is record 0 */
+#define TREE_BUCKETS 0x4      /* leaves hold blocks of points: left is -1 - the index of
+                                 their first point, right how many there are */
+
+enum formats {
+    FORMAT_TEXT = 0,
+    FORMAT_BIN = 1
+};
+
+enum layouts {
+    LAYOUT_ID = 0,  /* records by node id */
+    LAYOUT_VEB = 1  /* records in van Emde Boas order */
+};
+
+typedef struct _tree_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t flags;
+    int32_t n_dims;
+    int64_t n_nodes;
+} tree_header_t;
+
+typedef struct _tree_record {
+    int64_t id;
+    int64_t left;
+    int64_t right;
+    double radius;
+} tree_record_t;
+
+long tree_nodes(long size, long leaf_size);
+
+/* The serial and OpenMP trees are implicit in their preorder ids: a node over
+ * size points has its left child, over size / 2 of them, at id + 1 and its
+ * right child right after the left subtree, and is a leaf when it has at most
+ * leaf_size points. With single-point leaves the right child is at
+ * id + 2 * (size / 2) */
+static inline long left_child(long id, long size, long leaf_size)
+{
+    return size > leaf_size ? id + 1 : -1;
+}
+
+static inline long right_child(long id, long size, long leaf_size)
+{
+    return size > leaf_size ? id + 1 + tree_nodes(size / 2, leaf_size) : -1;
+}
+
+/* Bucket leaves, see TREE_BUCKETS */
+static inline void set_bucket(tree_record_t *record, long first, long count)
+{
+    record->left = -1 - first;
+    record->right = count;
+}
+
+static inline long bucket_first(const tree_record_t *record)
+{
+    return -1 - record->left;
+}
+
+int parse_format(const char *arg);
+int parse_layout(const char *arg);
+long parse_leaf_size(const char *arg);
+void veb_order(long n_points, long leaf_size, void (*visit)(long id, long first, long size));
+void write_tree_header(FILE *fp, int n_dims, long n_nodes, unsigned flags);
+
+/* Copies the point at position i of the built tree into p */
+typedef void (*point_t)(long i, double *p);
+
+void dump_tree_bin(FILE *fp, int n_dims, long n_points, long leaf_size,
+                   const double *radii, const double *centers, point_t point);
+void dump_tree_veb(FILE *fp, int n_dims, long n_points, long leaf_size,
+                   const double *radii, const double *centers, point_t point);
+int read_tree_header(FILE *fp, tree_header_t *header);
+const char *tree_error(int err);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "tree_writer.h"
+
+#define WRITER_BUFFER (1 << 22)
+
+struct _tree_writer {
+    int fd;
+    int n_dims;
+    char *buffers[2];
+    int current;            /* buffer being filled */
+    size_t used;            /* bytes in it */
+    size_t pending;         /* bytes of the other one still to be written, 0 once free */
+    int closing;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static char *format_digits(char *out, uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        *out++ = digits[--n];
+    return out;
+}
+
+/* Writes value as "%ld" would; returns the end of the text */
+char *format_long(char *out, long value)
+{
+    if (value < 0) {
+        *out++ = '-';
+        return format_digits(out, -(uint64_t) value);
+    }
+    return format_digits(out, value);
+}
+
+/* Millionths in frac, a double in [0, 1), rounded to nearest with ties to
+ * even as printf does. frac is mant * 2^-shift exactly, so the rounding is
+ * done on the exact product in integers */
+static uint64_t millionths(double frac)
+{
+    int exp;
+    uint64_t mant;
+    int shift;
+    unsigned __int128 product, rest, half;
+    uint64_t q;
+
+    if (frac == 0.0)
+        return 0;
+    mant = (uint64_t) ldexp(frexp(frac, &exp), 53);
+    shift = 53 - exp;
+    if (shift >= 128)   /* below 2^-74, far from half a millionth */
+        return 0;
+
+    product = (unsigned __int128) mant * 1000000;
+    q = (uint64_t) (product >> shift);
+    rest = product - ((unsigned __int128) q << shift);
+    half = (unsigned __int128) 1 << (shift - 1);
+    if (rest > half || (rest == half && (q & 1)))
+        q++;
+    return q;
+}
+
+/* Writes value as "%lf" would, six decimals correctly rounded; returns the
+ * end of the text */
+char *format_fixed(char *out, double value)
+{
+    double magnitude = fabs(value), whole;
+    uint64_t integer, fraction;
+
+    /* Beyond 2^53 doubles are integers with many digits, and inf and nan
+     * print as words; these are rare enough for printf */
+    if (!(magnitude < 0x1p53))
+        return out + sprintf(out, "%lf", value);
+
+    if (signbit(value))
+        *out++ = '-';
+    whole = trunc(magnitude);
+    integer = (uint64_t) whole;
+    fraction = millionths(magnitude - whole);
+    if (fraction == 1000000) {
+        integer++;
+        fraction = 0;
+    }
+
+    out = format_digits(out, integer);
+    *out++ = '.';
+    for (int d = 5; d >= 0; d--) {
+        out[d] = '0' + fraction % 10;
+        fraction /= 10;
+    }
+    return out + 6;
+}
+
+/* Writes the line of a node, at most NODE_TEXT_MAX(n_dims) bytes; returns
+ * the end of the text */
+char *format_node(char *out, long id, long left, long right, double radius,
+                  const double *center, int n_dims)
+{
+    out = format_long(out, id);
+    *out++ = ' ';
+    out = format_long(out, left);
+    *out++ = ' ';
+    out = format_long(out, right);
+    *out++ = ' ';
+    out = format_fixed(out, radius);
+    for (int d = 0; d < n_dims; d++) {
+        *out++ = ' ';
+        out = format_fixed(out, center[d]);
+    }
+    *out++ = ' ';
+    *out++ = '\n';
+    return out;
+}
+
+static void write_all(int fd, const char *bytes, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+
+        if (written < 0) {
+            perror("Error writing tree");
+            exit(1);
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+/* Writes each buffer handed over by writer_flush, until the writer closes */
+static void *writer_thread(void *arg)
+{
+    tree_writer_t *writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (!writer->pending && !writer->closing)
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        if (!writer->pending)
+            break;
+
+        /* the buffers only swap once pending is back to 0 */
+        char *bytes = writer->buffers[!writer->current];
+        size_t size = writer->pending;
+
+        pthread_mutex_unlock(&writer->lock);
+        write_all(writer->fd, bytes, size);
+        pthread_mutex_lock(&writer->lock);
+
+        writer->pending = 0;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+/* Hands the current buffer to the thread and carries on in the other one,
+ * once the thread is done with it */
+static void writer_flush(tree_writer_t *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    while (writer->pending)
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    writer->pending = writer->used;
+    writer->current = !writer->current;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    writer->used = 0;
+}
+
+/* Room for size more bytes in the current buffer */
+static char *writer_reserve(tree_writer_t *writer, size_t size)
+{
+    if (writer->used + size > WRITER_BUFFER)
+        writer_flush(writer);
+    return &writer->buffers[writer->current][writer->used];
+}
+
+static void writer_commit(tree_writer_t *writer, char *end)
+{
+    writer->used = end - writer->buffers[writer->current];
+}
+
+/* Takes over fp's file descriptor, after flushing whatever fp has buffered;
+ * nothing else may be written to fp until writer_close */
+tree_writer_t *writer_open(FILE *fp, int n_dims)
+{
+    tree_writer_t *writer = (tree_writer_t *) malloc(sizeof(tree_writer_t));
+
+    if (writer == NULL || NODE_TEXT_MAX(n_dims) > WRITER_BUFFER)
+        return NULL;
+    writer->buffers[0] = (char *) malloc(WRITER_BUFFER);
+    writer->buffers[1] = (char *) malloc(WRITER_BUFFER);
+    if (writer->buffers[0] == NULL || writer->buffers[1] == NULL)
+        return NULL;
+
+    fflush(fp);
+    writer->fd = fileno(fp);
+    writer->n_dims = n_dims;
+    writer->current = 0;
+    writer->used = 0;
+    writer->pending = 0;
+    writer->closing = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0)
+        return NULL;
+    return writer;
+}
+
+void writer_header(tree_writer_t *writer, int n_dims, long n_nodes)
+{
+    char *out = writer_reserve(writer, 2 * 21 + 2);
+
+    out = format_long(out, n_dims);
+    *out++ = ' ';
+    out = format_long(out, n_nodes);
+    *out++ = '\n';
+    writer_commit(writer, out);
+}
+
+void writer_node(tree_writer_t *writer, long id, long left, long right, double radius,
+                 const double *center)
+{
+    char *out = writer_reserve(writer, NODE_TEXT_MAX(writer->n_dims));
+
+    writer_commit(writer, format_node(out, id, left, right, radius, center, writer->n_dims));
+}
+
+/* Writes out what is left, waits for the thread and frees the writer */
+void writer_close(tree_writer_t *writer)
+{
+    if (writer->used)
+        writer_flush(writer);
+
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    free(writer->buffers[0]);
+    free(writer->buffers[1]);
+    free(writer);
+}
@@ -0,0 +1,32 @@
+#ifndef TREE_WRITER_H
+#define TREE_WRITER_H
+
+#include <stdio.h>
+
+/*
+ * Text tree output without printf: node lines are formatted straight into a
+ * large buffer, and full buffers are written by a background thread while
+ * the next one fills, so the output can be fed while the tree is still being
+ * built. The text is byte for byte what printf would write:
+ *   "%d %ld\n"                          header
+ *   "%ld %ld %ld %lf" (" %lf")* " \n"   node: id, left, right, radius, center
+ */
+
+typedef struct _tree_writer tree_writer_t;
+
+/* Most bytes format_fixed and format_node write */
+#define FIXED_TEXT_MAX 330
+#define NODE_TEXT_MAX(n_dims) (3 * 21 + ((n_dims) + 1) * (FIXED_TEXT_MAX + 1) + 2)
+
+char *format_long(char *out, long value);
+char *format_fixed(char *out, double value);
+char *format_node(char *out, long id, long left, long right, double radius,
+                  const double *center, int n_dims);
+
+tree_writer_t *writer_open(FILE *fp, int n_dims);
+void writer_header(tree_writer_t *writer, int n_dims, long n_nodes);
+void writer_node(tree_writer_t *writer, long id, long left, long right, double radius,
+                 const double *center);
+void writer_close(tree_writer_t *writer);
+
+#endif